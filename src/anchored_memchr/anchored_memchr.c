@@ -1,75 +1,378 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "anchored_memchr.h"
 
 #define STEP_SIZE       256
+#define CACHE_LINE      64
+
+/* one byte per value, a single load rejects bytes the pattern doesn't contain */
+#define BMAP_SET(bmap, ch)  ((bmap)[(ch)] = 1)
+#define BMAP_TEST(bmap, ch) ((bmap)[(ch)])
+
+static inline uint16_t load16(const unsigned char *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#define PUSH_MATCH(off) do { \
+    offs[matched++] = (offset_t)(off); \
+    if (matched == off_size) { \
+        off_size += STEP_SIZE; \
+        offs = realloc(offs, off_size * sizeof(offset_t)); \
+    } \
+} while (0)
+
+/*
+compare helpers, `p` points to a candidate of exactly plen bytes
+short patterns are compared as two overlapping head/tail words,
+so every load stays inside [p, p + plen)
+*/
+#define EQ_MEMCMP(p) (memcmp(idx->patt, (p), patlen) == 0)
+#define EQ_16(p) (load16(p) == (uint16_t)idx->head[0] && \
+                  load16((p) + patlen - 2) == (uint16_t)idx->tail[0])
+#define EQ_32(p) (load32(p) == (uint32_t)idx->head[0] && \
+                  load32((p) + patlen - 4) == (uint32_t)idx->tail[0])
+#define EQ_64(p) (load64(p) == idx->head[0] && \
+                  load64((p) + patlen - 8) == idx->tail[0])
+#define EQ_128(p) (((load64(p) ^ idx->head[0]) | \
+                    (load64((p) + 8) ^ idx->head[1]) | \
+                    (load64((p) + patlen - 16) ^ idx->tail[0]) | \
+                    (load64((p) + patlen - 8) ^ idx->tail[1])) == 0)
+
+/*
+stride-anchored walk, instantiated once per compare helper and position type
+so the verification step is inlined for each length class
+*/
+#define DEFINE_KERNEL(name, EQ, POS_T) \
+static offset_t *name(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) { \
+    const size_t patlen = idx->plen; \
+    const uint8_t *bmap = idx->bmap; \
+    const uint32_t *boff = idx->boff; \
+    const POS_T *bpos = (const POS_T *)idx->bpos; \
+    int matched = 0; \
+    size_t off_size = STEP_SIZE; \
+    offset_t *offs = malloc(off_size * sizeof(offset_t)); \
+    if ((size_t)(end - start) < patlen) { \
+        *count = 0; \
+        return offs; \
+    } \
+    unsigned char *edge = end - patlen - 1; \
+    unsigned char *chbase = start + patlen - 1; \
+    for (; chbase <= edge; chbase += patlen) { \
+        const unsigned char ch = *chbase; \
+        if (!BMAP_TEST(bmap, ch)) \
+            continue; \
+        for (uint32_t j = boff[ch]; j < boff[ch + 1]; j++) { \
+            unsigned char *cur = chbase - bpos[j]; \
+            if (EQ(cur)) \
+                PUSH_MATCH(cur - start); \
+        } \
+    } \
+    for (uint32_t i = boff[*chbase]; i < boff[*chbase + 1]; i++) { \
+        unsigned char *cur = chbase - bpos[i]; \
+        if (cur + patlen <= end && EQ(cur)) \
+            PUSH_MATCH(cur - start); \
+    } \
+    *count = matched; \
+    return offs; \
+}
+
+DEFINE_KERNEL(match_2_3, EQ_16, uint8_t)
+DEFINE_KERNEL(match_4_7, EQ_32, uint8_t)
+DEFINE_KERNEL(match_8_15, EQ_64, uint8_t)
+DEFINE_KERNEL(match_16_32, EQ_128, uint8_t)
+DEFINE_KERNEL(match_generic8, EQ_MEMCMP, uint8_t)
+DEFINE_KERNEL(match_generic16, EQ_MEMCMP, uint16_t)
+DEFINE_KERNEL(match_generic32, EQ_MEMCMP, uint32_t)
+
+/* an empty pattern has no stride to anchor on and matches nothing */
+static offset_t *match_0(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) {
+    (void)idx;
+    (void)start;
+    (void)end;
+    *count = 0;
+    return (offset_t *)malloc(STEP_SIZE * sizeof(offset_t));
+}
+
+/* stride would be 1, let libc's memchr do the scanning */
+static offset_t *match_1(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) {
+    const unsigned char ch = idx->patt[0];
+    int matched = 0;
+    size_t off_size = STEP_SIZE;
+    offset_t *offs = malloc(off_size * sizeof(offset_t));
+    unsigned char *cur = start;
+    while (cur < end && (cur = memchr(cur, ch, end - cur)) != NULL) {
+        PUSH_MATCH(cur - start);
+        cur++;
+    }
+    *count = matched;
+    return offs;
+}
+
+static inline int fold_equal(const unsigned char *p, const anchored_memchr_var_t *var) {
+    size_t k = 0;
+    for (; k + 8 <= var->len; k += 8) {
+        if ((load64(p + k) | load64(var->fold + k)) != load64(var->patt + k))
+            return 0;
+    }
+    for (; k < var->len; k++) {
+        if ((p[k] | var->fold[k]) != var->patt[k])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+every variant's first plen bytes are indexed, so any match of any variant
+has exactly one anchor inside it. candidates at one anchor come out in offset
+order, so a position matched by two variants is reported once
+*/
+static offset_t *match_set(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) {
+    const size_t stride = idx->plen;
+    const uint8_t *bmap = idx->bmap;
+    const uint32_t *boff = idx->boff;
+    const uint32_t *bpos = (const uint32_t *)idx->bpos;
+    int matched = 0;
+    size_t off_size = STEP_SIZE;
+    offset_t *offs = malloc(off_size * sizeof(offset_t));
+    if ((size_t)(end - start) < stride) {
+        *count = 0;
+        return offs;
+    }
+    for (unsigned char *chbase = start + stride - 1; chbase < end; chbase += stride) {
+        const unsigned char ch = *chbase;
+        if (!BMAP_TEST(bmap, ch))
+            continue;
+        for (uint32_t j = boff[ch]; j < boff[ch + 1]; j++) {
+            unsigned char *cur = chbase - bpos[j];
+            const anchored_memchr_var_t *var = &idx->vars[idx->bvar[j]];
+            if ((size_t)(end - cur) < var->len || !fold_equal(cur, var))
+                continue;
+            if (matched > 0 && offset_of(offs[matched - 1]) == (offset_t)(cur - start))
+                continue;
+            PUSH_MATCH((offset_t)(cur - start) | (offset_t)idx->bvar[j] << OFFSET_BITS);
+        }
+    }
+    *count = matched;
+    return offs;
+}
+
+/*
+bucket positions use the narrowest type that can hold patlen - 1
+*/
+static size_t position_width(size_t patlen) {
+    if (patlen <= 0x100) return sizeof(uint8_t);
+    if (patlen <= 0x10000) return sizeof(uint16_t);
+    return sizeof(uint32_t);
+}
+
+static void store_position(void *bpos, size_t width, uint32_t at, size_t val) {
+    if (width == sizeof(uint8_t)) ((uint8_t *)bpos)[at] = (uint8_t)val;
+    else if (width == sizeof(uint16_t)) ((uint16_t *)bpos)[at] = (uint16_t)val;
+    else ((uint32_t *)bpos)[at] = (uint32_t)val;
+}
 
 void anchored_memchr_init(anchored_memchr_idx_t *idx, size_t patlen, const unsigned char *pattern) {
-    int bufidx = 1;
     unsigned char *patt = (unsigned char *)malloc((patlen + 1) * sizeof(unsigned char));
-    int *bucket = (int *)malloc(ASIZE * sizeof(int));
-    node_t *buffer = (node_t *)malloc((patlen + 1) * sizeof(node_t));
     memcpy(patt, pattern, patlen);
-    memset(bucket, 0, ASIZE * sizeof(int));
-    for (int i = 0; i < patlen; i++) {
-        buffer[bufidx].val = i;
-        buffer[bufidx].nxt = bucket[pattern[i]];
-        bucket[pattern[i]] = bufidx;
-        bufidx++;
+
+    /*
+    flat layout in one cache-line aligned block:
+    boff[ASIZE + 1] bucket start offsets, then every pattern position grouped
+    by byte value, descending inside a bucket so candidates come out in order
+    */
+    size_t width = position_width(patlen);
+    size_t boff_size = (ASIZE + 1) * sizeof(uint32_t);
+    size_t block_size = boff_size + patlen * width;
+    block_size = (block_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    uint32_t *boff = (uint32_t *)aligned_alloc(CACHE_LINE, block_size);
+    void *bpos = (unsigned char *)boff + boff_size;
+
+    uint32_t fill[ASIZE];
+    memset(boff, 0, boff_size);
+    memset(idx->bmap, 0, sizeof(idx->bmap));
+    for (size_t i = 0; i < patlen; i++) {
+        boff[pattern[i] + 1]++;
+        BMAP_SET(idx->bmap, pattern[i]);
     }
+    for (int c = 0; c < ASIZE; c++) {
+        boff[c + 1] += boff[c];
+        fill[c] = boff[c];
+    }
+    for (size_t i = patlen; i-- > 0;) {
+        store_position(bpos, width, fill[pattern[i]]++, i);
+    }
+
     idx->plen = patlen;
+    idx->maxlen = patlen;
+    idx->nvar = 1;
+    idx->vars = NULL;
+    idx->bvar = NULL;
     idx->patt = patt;
-    idx->buck = bucket;
-    idx->buff = buffer;
+    idx->boff = boff;
+    idx->bpos = bpos;
+
+    // pick the kernel for this length and pre-load its compare words
+    memset(idx->head, 0, sizeof(idx->head));
+    memset(idx->tail, 0, sizeof(idx->tail));
+    if (patlen == 0) {
+        idx->kern = match_0;
+    }
+    else if (patlen == 1) {
+        idx->kern = match_1;
+    }
+    else if (patlen <= 3) {
+        idx->head[0] = load16(patt);
+        idx->tail[0] = load16(patt + patlen - 2);
+        idx->kern = match_2_3;
+    }
+    else if (patlen <= 7) {
+        idx->head[0] = load32(patt);
+        idx->tail[0] = load32(patt + patlen - 4);
+        idx->kern = match_4_7;
+    }
+    else if (patlen <= 15) {
+        idx->head[0] = load64(patt);
+        idx->tail[0] = load64(patt + patlen - 8);
+        idx->kern = match_8_15;
+    }
+    else if (patlen <= 32) {
+        idx->head[0] = load64(patt);
+        idx->head[1] = load64(patt + 8);
+        idx->tail[0] = load64(patt + patlen - 16);
+        idx->tail[1] = load64(patt + patlen - 8);
+        idx->kern = match_16_32;
+    }
+    else if (width == sizeof(uint8_t)) {
+        idx->kern = match_generic8;
+    }
+    else if (width == sizeof(uint16_t)) {
+        idx->kern = match_generic16;
+    }
+    else {
+        idx->kern = match_generic32;
+    }
     return;
 }
 
-offset_t *anchored_memchr_match(anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) {
-    size_t patlen = idx->plen;
-    unsigned char *pattern = idx->patt;
-    int *bucket = idx->buck;
-    node_t *buffer = idx->buff;
+void anchored_memchr_init_set(anchored_memchr_idx_t *idx, int nvar, const anchored_memchr_var_t *vars) {
+    bool folded = false;
+    for (int v = 0; v < nvar; v++)
+        folded = folded || vars[v].fold != NULL;
+    if (nvar == 1 && !folded) {
+        anchored_memchr_init(idx, vars[0].len, vars[0].patt);
+        return;
+    }
 
-    int matched = 0;
-    size_t off_size = STEP_SIZE;
-    offset_t *offs = malloc(off_size * sizeof(offset_t));
-    unsigned char *edge = end - patlen - 1;
-    unsigned char *chbase = start + patlen - 1;
-    for (; chbase <= edge; chbase += patlen) {
-        for (int j = bucket[*chbase]; j; j = buffer[j].nxt) {
-            unsigned char *cur = chbase - buffer[j].val;
-            if (memcmp(pattern, cur, patlen) == 0) {
-                offs[matched++] = (offset_t)(cur - start);
-                if (matched == off_size) {
-                    off_size += STEP_SIZE;
-                    offs = realloc(offs, off_size * sizeof(offset_t));
-                }
+    size_t stride = vars[0].len, maxlen = vars[0].len;
+    idx->vars = (anchored_memchr_var_t *)malloc((size_t)nvar * sizeof(anchored_memchr_var_t));
+    for (int v = 0; v < nvar; v++) {
+        anchored_memchr_var_t *var = &idx->vars[v];
+        var->len = vars[v].len;
+        var->patt = (unsigned char *)malloc(var->len);
+        var->fold = (unsigned char *)calloc(var->len, 1);
+        if (vars[v].fold != NULL)
+            memcpy(var->fold, vars[v].fold, var->len);
+        for (size_t k = 0; k < var->len; k++)
+            var->patt[k] = vars[v].patt[k] | var->fold[k];
+        if (var->len < stride) stride = var->len;
+        if (var->len > maxlen) maxlen = var->len;
+    }
+
+    // a folded letter is filed under both cases
+    size_t entries = 0;
+    for (int v = 0; v < nvar; v++)
+        for (size_t i = 0; i < stride; i++)
+            entries += idx->vars[v].fold[i] ? 2 : 1;
+
+    size_t boff_size = (ASIZE + 1) * sizeof(uint32_t);
+    size_t block_size = boff_size + entries * sizeof(uint32_t);
+    block_size = (block_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    uint32_t *boff = (uint32_t *)aligned_alloc(CACHE_LINE, block_size);
+    uint32_t *bpos = (uint32_t *)((unsigned char *)boff + boff_size);
+    uint8_t *bvar = (uint8_t *)malloc(entries);
+
+    uint32_t fill[ASIZE];
+    memset(boff, 0, boff_size);
+    memset(idx->bmap, 0, sizeof(idx->bmap));
+    for (int v = 0; v < nvar; v++) {
+        for (size_t i = 0; i < stride; i++) {
+            unsigned char ch = idx->vars[v].patt[i];
+            boff[ch + 1]++;
+            BMAP_SET(idx->bmap, ch);
+            if (idx->vars[v].fold[i]) {
+                ch &= ~idx->vars[v].fold[i];
+                boff[ch + 1]++;
+                BMAP_SET(idx->bmap, ch);
             }
         }
     }
-    for (int i = bucket[*chbase]; i; i = buffer[i].nxt) {
-        unsigned char *cur = chbase - buffer[i].val;
-        if (cur + patlen <= end) {
-            if (memcmp(pattern, cur, patlen) == 0) {
-                offs[matched++] = (offset_t)(cur - start);
-                if (matched == off_size) {
-                    off_size += STEP_SIZE;
-                    offs = realloc(offs, off_size * sizeof(offset_t));
-                }
+    for (int c = 0; c < ASIZE; c++) {
+        boff[c + 1] += boff[c];
+        fill[c] = boff[c];
+    }
+    // descending position, then variant order, keeps candidates sorted
+    for (size_t i = stride; i-- > 0;) {
+        for (int v = 0; v < nvar; v++) {
+            unsigned char ch = idx->vars[v].patt[i];
+            bpos[fill[ch]] = (uint32_t)i;
+            bvar[fill[ch]++] = (uint8_t)v;
+            if (idx->vars[v].fold[i]) {
+                ch &= ~idx->vars[v].fold[i];
+                bpos[fill[ch]] = (uint32_t)i;
+                bvar[fill[ch]++] = (uint8_t)v;
             }
         }
     }
-    *count = matched;
-    return offs;
+
+    idx->plen = stride;
+    idx->maxlen = maxlen;
+    idx->nvar = nvar;
+    idx->bvar = bvar;
+    idx->patt = NULL;
+    idx->boff = boff;
+    idx->bpos = bpos;
+    memset(idx->head, 0, sizeof(idx->head));
+    memset(idx->tail, 0, sizeof(idx->tail));
+    idx->kern = stride > 0 ? match_set : match_0;
+    return;
+}
+
+offset_t *anchored_memchr_match(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count) {
+    return idx->kern(idx, start, end, count);
 }
 
 void anchored_memchr_release(anchored_memchr_idx_t *idx) {
+    if (idx->vars != NULL) {
+        for (int v = 0; v < idx->nvar; v++) {
+            free(idx->vars[v].patt);
+            free(idx->vars[v].fold);
+        }
+        free(idx->vars);
+        free(idx->bvar);
+        idx->vars = NULL;
+        idx->bvar = NULL;
+    }
     free(idx->patt);
-    free(idx->buck);
-    free(idx->buff);
+    free(idx->boff);
     idx->patt = NULL;
-    idx->buck = NULL;
-    idx->buff = NULL;
+    idx->boff = NULL;
+    idx->bpos = NULL;
+    idx->kern = NULL;
     return;
-}
\ No newline at end of file
+}
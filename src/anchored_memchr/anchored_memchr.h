@@ -8,25 +8,63 @@
 #define ASIZE 0x100
 
 typedef unsigned long long offset_t;
+
+/*
+offsets from a pattern set carry the index of the matching variant in the top bits,
+a single pattern always has variant 0
+*/
+#define OFFSET_BITS 56
+#define OFFSET_MASK ((1ULL << OFFSET_BITS) - 1)
+#define offset_of(off)  ((off) & OFFSET_MASK)
+#define variant_of(off) ((int)((off) >> OFFSET_BITS))
+#define MAX_VARIANTS 255
+
+/* one member of a pattern set, bytes with a fold bit set match either ASCII case */
 typedef struct {
-    int val;
-    int nxt;
-} node_t;
-typedef struct {
+    size_t len;
+    unsigned char *patt;         // stored with fold bits applied
+    unsigned char *fold;         // 0x20 on ASCII letters to compare caselessly, NULL for none
+} anchored_memchr_var_t;
+
+typedef struct anchored_memchr_idx anchored_memchr_idx_t;
+
+/* length-specialized match kernel, selected by anchored_memchr_init */
+typedef offset_t *(*anchored_memchr_kern_t)(const anchored_memchr_idx_t *idx,
+                                            unsigned char *start, unsigned char *end, int *count);
+
+/*
+read-only once built, a single index can be shared by all threads
+positions of byte c in the pattern are bpos[boff[c]] .. bpos[boff[c + 1] - 1],
+stored as u8, u16 or u32 depending on plen
+for a pattern set, plen is the shortest variant and positions are u32 with
+the variant of each one in bvar
+*/
+struct anchored_memchr_idx {
     size_t plen;
+    size_t maxlen;               // longest variant, plen for a single pattern
+    int nvar;
+    anchored_memchr_var_t *vars; // NULL for a single pattern
+    uint8_t *bvar;
     unsigned char *patt;
-    int *buck;
-    node_t *buff;
-} anchored_memchr_idx_t;
+    uint8_t bmap[ASIZE];         // 1 for bytes present in the pattern
+    uint32_t *boff;              // ASIZE + 1 bucket offsets, owns the block
+    void *bpos;                  // positions, inside the boff block
+    uint64_t head[2];            // leading pattern words for short kernels
+    uint64_t tail[2];            // trailing pattern words for short kernels
+    anchored_memchr_kern_t kern;
+};
 
 void anchored_memchr_init(anchored_memchr_idx_t *idx, size_t patlen, const unsigned char *pattern);
 
+/* several variants searched in one pass, at most MAX_VARIANTS */
+void anchored_memchr_init_set(anchored_memchr_idx_t *idx, int nvar, const anchored_memchr_var_t *vars);
+
 /*
 end won't be reached!
 [start, end)
 end = start + len
 */
-offset_t *anchored_memchr_match(anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count);
+offset_t *anchored_memchr_match(const anchored_memchr_idx_t *idx, unsigned char *start, unsigned char *end, int *count);
 
 void anchored_memchr_release(anchored_memchr_idx_t *idx);
 
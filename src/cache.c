@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "private.h"
+#include "anchored_memchr/anchored_memchr.h"
+#include "pool/pool.h"
+
+#define CACHE_MAGIC   0x32637078u // "xpc2"
+#define HASH_LANES    8
+#define HASH_STRIPE   (HASH_LANES * 8)
+#define HASH_TASK     64                  // blocks hashed by one pool job
+
+#define PRIME32_1 0x9E3779B1ULL
+#define PRIME32_2 0x85EBCA77ULL
+#define PRIME32_3 0xC2B2AE3DULL
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const uint64_t hash_keys[HASH_LANES] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+/* result file header, followed by `count` offsets */
+struct cache_results {
+    uint32_t magic;
+    uint32_t nvar;
+    uint64_t count;
+};
+
+/* stat pre-check record, maps an unchanged file to its content hash */
+struct cache_stamp {
+    uint32_t magic;
+    uint32_t pad;
+    file_stamp_t stamp;
+    uint64_t content;
+};
+
+/* a run of HASH_BLOCKs hashed by one pool job */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    uint64_t *hashes;
+    pool_job_t job;
+} hash_task_t;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* 32x32->64 multiplies over independent lanes, the loop vectorizes with SSE2/NEON */
+static inline void hash_stripe(uint64_t *acc, const unsigned char *p) {
+    uint64_t data[HASH_LANES], swapped[HASH_LANES];
+    memcpy(data, p, HASH_STRIPE);
+    for (int i = 0; i < HASH_LANES; i++)
+        swapped[i] = data[i ^ 1];
+    for (int i = 0; i < HASH_LANES; i++) {
+        uint64_t key = data[i] ^ hash_keys[i];
+        acc[i] += swapped[i] + (key & 0xffffffff) * (key >> 32);
+    }
+}
+
+static inline void hash_scramble(uint64_t *acc) {
+    for (int i = 0; i < HASH_LANES; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= hash_keys[i];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+uint64_t block_hash(const unsigned char *data, size_t len) {
+    uint64_t acc[HASH_LANES] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    };
+    size_t stripes = len / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; s++) {
+        hash_stripe(acc, data + s * HASH_STRIPE);
+        if ((s & 15) == 15)
+            hash_scramble(acc);
+    }
+    size_t rest = len - stripes * HASH_STRIPE;
+    if (rest > 0) {
+        unsigned char last[HASH_STRIPE] = {0};
+        memcpy(last, data + stripes * HASH_STRIPE, rest);
+        hash_stripe(acc, last);
+    }
+
+    uint64_t h = (uint64_t)len * PRIME64_1;
+    for (int i = 0; i < HASH_LANES; i++) {
+        h ^= avalanche(acc[i] + hash_keys[i]);
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    return avalanche(h);
+}
+
+/* the whole file, from the hash of each HASH_BLOCK */
+static uint64_t content_key(const content_hash_t *ch) {
+    return block_hash((const unsigned char *)ch->blocks, ch->nblocks * sizeof(uint64_t)) ^ ch->size;
+}
+
+/* every variant with its fold mask, so --icase and --encoding give distinct keys */
+static uint64_t pattern_key(const anchored_memchr_idx_t *idx) {
+    size_t len = 0;
+    for (int v = 0; v < idx->nvar; v++)
+        len += 8 + (idx->vars != NULL ? idx->vars[v].len * 2 : idx->plen);
+    unsigned char *buf = calloc(len, 1), *p = buf;
+    for (int v = 0; v < idx->nvar; v++) {
+        uint64_t plen = idx->vars != NULL ? idx->vars[v].len : idx->plen;
+        memcpy(p, &plen, 8);
+        memcpy(p + 8, idx->vars != NULL ? idx->vars[v].patt : idx->patt, plen);
+        p += 8 + plen;
+        if (idx->vars != NULL) {
+            if (idx->vars[v].fold != NULL)
+                memcpy(p, idx->vars[v].fold, plen);
+            p += plen;
+        }
+    }
+    uint64_t h = block_hash(buf, len) ^ (uint64_t)idx->nvar;
+    free(buf);
+    return h;
+}
+
+static int file_stamp(FILE *fp, file_stamp_t *stamp) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return 1;
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = (uint64_t)st.st_dev;
+    stamp->ino = (uint64_t)st.st_ino;
+    stamp->size = (uint64_t)st.st_size;
+    stamp->mtime = (uint64_t)ST_MTIM(st).tv_sec;
+    stamp->mtime_nsec = (uint64_t)ST_MTIM(st).tv_nsec;
+    stamp->ctime = (uint64_t)ST_CTIM(st).tv_sec;
+    stamp->ctime_nsec = (uint64_t)ST_CTIM(st).tv_nsec;
+    return 0;
+}
+
+static void stamp_path(char *path, size_t size, const file_stamp_t *stamp) {
+    snprintf(path, size, "%s/stat-%016llx", cache_dir,
+             (unsigned long long)block_hash((const unsigned char *)stamp, sizeof(*stamp)));
+}
+
+static void results_path(char *path, size_t size, uint64_t content, uint64_t file_size, uint64_t pattern) {
+    snprintf(path, size, "%s/%016llx-%llx-%016llx", cache_dir, (unsigned long long)content,
+             (unsigned long long)file_size, (unsigned long long)pattern);
+}
+
+/* write to a temporary file and rename over `path`, so readers never see a partial entry */
+static int write_entry(const char *path, const void *head, size_t head_len, const void *body, size_t body_len) {
+    char tmp[4096 + 64];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL)
+        return 1;
+    bool ok = fwrite(head, 1, head_len, fp) == head_len &&
+              (body_len == 0 || fwrite(body, 1, body_len, fp) == body_len);
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+static void store_stamp(const file_stamp_t *stamp, uint64_t content) {
+    // a file modified again within the same tick would keep its stamp
+    if ((int64_t)stamp->mtime >= (int64_t)time(NULL) - 1 || (int64_t)stamp->ctime >= (int64_t)time(NULL) - 1)
+        return;
+    char path[4096 + 64];
+    struct cache_stamp rec = {CACHE_MAGIC, 0, *stamp, content};
+    stamp_path(path, sizeof(path), stamp);
+    write_entry(path, &rec, sizeof(rec), NULL, 0);
+}
+
+/* marks that results for some content of this size were stored for the pattern */
+static void size_path(char *path, size_t size, uint64_t file_size, uint64_t pattern) {
+    snprintf(path, size, "%s/size-%llx-%016llx", cache_dir, (unsigned long long)file_size,
+             (unsigned long long)pattern);
+}
+
+static bool results_for_size(uint64_t file_size, uint64_t pattern) {
+    char path[4096 + 64];
+    struct stat st;
+    size_path(path, sizeof(path), file_size, pattern);
+    return stat(path, &st) == 0;
+}
+
+static void hash_worker(void *arg) {
+    hash_task_t *task = (hash_task_t *)arg;
+    for (size_t off = 0; off < task->len; off += HASH_BLOCK) {
+        size_t len = task->len - off < HASH_BLOCK ? task->len - off : HASH_BLOCK;
+        task->hashes[off / HASH_BLOCK] = block_hash(task->data + off, len);
+    }
+}
+
+/*
+content hash of `fp` without searching it, the same blocks the scan hashes
+holes read back as zeros and hash like the zero blocks the scan fills in
+*/
+static int hash_file(FILE *fp, uint64_t file_size, content_hash_t *ch) {
+    if (file_size == 0)
+        return 1;
+    unsigned char *map = mmap(NULL, (size_t)file_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+        return 1;
+    madvise(map, (size_t)file_size, MADV_SEQUENTIAL);
+
+    ch->size = file_size;
+    ch->nblocks = (size_t)((file_size + HASH_BLOCK - 1) / HASH_BLOCK);
+    ch->blocks = (uint64_t *)malloc(ch->nblocks * sizeof(uint64_t));
+    size_t ntasks = (ch->nblocks + HASH_TASK - 1) / HASH_TASK;
+    hash_task_t *tasks = malloc(ntasks * sizeof(hash_task_t));
+    pool_t *pool = num_threads == 1 ? NULL : get_search_pool();
+    for (size_t t = 0; t < ntasks; t++) {
+        size_t off = t * HASH_TASK * (size_t)HASH_BLOCK;
+        size_t len = file_size - off < HASH_TASK * (size_t)HASH_BLOCK ? file_size - off : HASH_TASK * HASH_BLOCK;
+        tasks[t] = (hash_task_t){
+            .data = map + off,
+            .len = len,
+            .hashes = ch->blocks + t * HASH_TASK,
+        };
+        if (pool != NULL)
+            pool_submit(pool, &tasks[t].job, hash_worker, &tasks[t]);
+        else
+            hash_worker(&tasks[t]);
+    }
+    for (size_t t = 0; pool != NULL && t < ntasks; t++)
+        pool_wait(pool, &tasks[t].job);
+    free(tasks);
+    munmap(map, (size_t)file_size);
+    ch->valid = true;
+    return 0;
+}
+
+static offset_t *read_results(uint64_t content, uint64_t file_size, const anchored_memchr_idx_t *idx,
+                              size_t *count) {
+    char path[4096 + 64];
+    results_path(path, sizeof(path), content, file_size, pattern_key(idx));
+    FILE *rf = fopen(path, "rb");
+    if (rf == NULL)
+        return NULL;
+    struct cache_results head;
+    offset_t *offsets = NULL;
+    if (fread(&head, sizeof(head), 1, rf) == 1 && head.magic == CACHE_MAGIC &&
+        head.nvar == (uint32_t)idx->nvar && head.count <= file_size) {
+        offsets = (offset_t *)malloc(head.count * sizeof(offset_t) + 1);
+        if (fread(offsets, sizeof(offset_t), head.count, rf) != head.count) {
+            free(offsets);
+            offsets = NULL;
+        }
+    }
+    fclose(rf);
+    if (offsets != NULL)
+        *count = (size_t)head.count;
+    return offsets;
+}
+
+/*
+offsets cached for the content of `fp`, NULL on a miss
+a file whose stamp is on record is looked up by the content it had then,
+any other file is hashed first when results for its size and pattern exist,
+so copies of a scanned file are answered without searching them
+*/
+offset_t *cache_lookup(FILE *fp, const anchored_memchr_idx_t *idx, file_stamp_t *stamp, size_t *count) {
+    *count = 0;
+    if (file_stamp(fp, stamp) != 0)
+        return NULL;
+
+    char path[4096 + 64];
+    stamp_path(path, sizeof(path), stamp);
+    FILE *sf = fopen(path, "rb");
+    if (sf != NULL) {
+        struct cache_stamp rec;
+        bool known = fread(&rec, sizeof(rec), 1, sf) == 1 && rec.magic == CACHE_MAGIC &&
+                     memcmp(&rec.stamp, stamp, sizeof(*stamp)) == 0;
+        fclose(sf);
+        if (known)
+            return read_results(rec.content, stamp->size, idx, count);
+    }
+
+    if (!results_for_size(stamp->size, pattern_key(idx)))
+        return NULL;
+    content_hash_t ch = {0};
+    offset_t *offsets = NULL;
+    file_stamp_t after;
+    if (hash_file(fp, stamp->size, &ch) == 0 && file_stamp(fp, &after) == 0 &&
+        memcmp(&after, stamp, sizeof(after)) == 0) {
+        uint64_t content = content_key(&ch);
+        offsets = read_results(content, stamp->size, idx, count);
+        if (offsets != NULL)
+            store_stamp(stamp, content);
+    }
+    free(ch.blocks);
+    return offsets;
+}
+
+/*
+record the offsets of a scan under its content hash, and the stamp of `fp`
+unless the file changed while it was scanned or too recently to be told apart
+*/
+void cache_store(FILE *fp, const anchored_memchr_idx_t *idx, const file_stamp_t *stamp, const content_hash_t *ch,
+                 const offset_t *offsets, size_t count) {
+    file_stamp_t after;
+    if (!ch->valid || file_stamp(fp, &after) != 0 || memcmp(&after, stamp, sizeof(after)) != 0)
+        return;
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "xsp: cannot create cache '%s': %s\n", cache_dir, strerror(errno));
+        return;
+    }
+
+    uint64_t content = content_key(ch);
+    uint64_t pattern = pattern_key(idx);
+    char path[4096 + 64];
+    results_path(path, sizeof(path), content, stamp->size, pattern);
+    struct cache_results head = {CACHE_MAGIC, (uint32_t)idx->nvar, count};
+    if (write_entry(path, &head, sizeof(head), offsets, count * sizeof(offset_t)) != 0) {
+        fprintf(stderr, "xsp: cannot write cache '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    // later files of this size are hashed and looked up, others go straight to the scan
+    size_path(path, sizeof(path), stamp->size, pattern);
+    if (!results_for_size(stamp->size, pattern))
+        write_entry(path, &head, 0, NULL, 0);
+    store_stamp(stamp, content);
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
 
 #include "private.h"
 
@@ -11,6 +13,25 @@ struct data hex1, hex2;
 char *file_path = NULL;
 struct range pat_range = {0, -1};
 int num_threads = 0;
+char *serve_path = NULL;
+char *connect_path = NULL;
+size_t window_size = 0;
+bool unique_mode = false;
+offset_t unique_at = 0;
+struct variant variants[MAX_ENCODINGS];
+int num_variants = 0;
+int decompress_mode = DECOMPRESS_NONE;
+int target_pid = 0;
+char *region_perms = NULL;
+char *region_name = NULL;
+char *cache_dir = NULL;
+
+enum ENCODING {
+    ENC_ASCII,
+    ENC_UTF16LE,
+    ENC_UTF16BE
+};
+static const char *encoding_names[MAX_ENCODINGS] = {"ascii", "utf16le", "utf16be"};
 
 void usage() {
     puts("xsp - hex search & patch tool");
@@ -20,7 +41,18 @@ void usage() {
     puts("  -r <range>         range of the matches, eg: '0,-1'");
     puts("  -t <threads>       number of threads to use (default: auto)");
     puts("  --str              treat args as string instead of hex string");
+    puts("  --icase            match strings ignoring ASCII case");
+    puts("  --encoding=<list>  string encodings to search, eg: 'ascii,utf16le'");
+    puts("  --decompress=<fmt> search inside compressed input: auto, gzip, zstd");
     puts("  --benchmark        run search performance benchmarks");
+    puts("  --unique-at <off>  find the shortest unique pattern covering offset");
+    puts("  --pid <pid>        search the memory of a running process");
+    puts("  --perm <flags>     with --pid, only mappings with these flags, eg: 'rx'");
+    puts("  --region <name>    with --pid, only mappings whose name contains name");
+    puts("  --window <size>    scan in mapped windows of size, eg: '512M', '1G'");
+    puts("  --cache <dir>      reuse search results for identical file contents");
+    puts("  --serve <socket>   run as a search daemon on a unix socket");
+    puts("  --connect <socket> send the request to a running daemon");
     puts("  -h, --help         print this usage");
     return;
 }
@@ -58,6 +90,105 @@ error:
     return (struct data){0, NULL};
 }
 
+/* size with optional K, M or G suffix, 0 if invalid or too large */
+static size_t parse_size(const char *str) {
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'G': case 'g': shift += 10; /* fall through */
+        case 'M': case 'm': shift += 10; /* fall through */
+        case 'K': case 'k': shift += 10; end++; break;
+        default: break;
+    }
+    if (end == str || *end != '\0' || !isdigit((unsigned char)str[0]) || errno == ERANGE)
+        return 0;
+    if (size > SIZE_MAX >> shift)
+        return 0;
+    return (size_t)size << shift;
+}
+
+/* decode one UTF-8 sequence, invalid bytes stand for themselves */
+static uint32_t next_codepoint(const unsigned char **str) {
+    const unsigned char *s = *str;
+    int extra = s[0] >= 0xf0 ? 3 : s[0] >= 0xe0 ? 2 : s[0] >= 0xc0 ? 1 : 0;
+    uint32_t cp = extra ? s[0] & (0x3f >> extra) : s[0];
+    for (int i = 1; i <= extra; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *str = s + 1;
+            return s[0];
+        }
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    *str = s + 1 + extra;
+    return cp;
+}
+
+static void put_unit(uint8_t *out, uint8_t *fold, size_t *len, uint16_t unit, int enc, bool letter) {
+    int low = enc == ENC_UTF16LE ? 0 : 1;
+    out[*len + low] = unit & 0xff;
+    out[*len + 1 - low] = unit >> 8;
+    if (letter)
+        fold[*len + low] = 0x20;
+    *len += 2;
+}
+
+/* `str` in the given encoding, fold marks ASCII letters when icase */
+static struct data encode_str(const char *str, int enc, bool icase, struct data *fold) {
+    size_t n = strlen(str);
+    size_t cap = enc == ENC_ASCII ? n : n * 2 + 2;
+    uint8_t *out = malloc(cap + 1);
+    fold->buf = calloc(cap + 1, 1);
+    size_t len = 0;
+    if (enc == ENC_ASCII) {
+        memcpy(out, str, n);
+        for (size_t i = 0; icase && i < n; i++)
+            if (isalpha((unsigned char)str[i]) && (unsigned char)str[i] < 0x80)
+                fold->buf[i] = 0x20;
+        len = n;
+    }
+    else {
+        const unsigned char *s = (const unsigned char *)str;
+        while (*s) {
+            uint32_t cp = next_codepoint(&s);
+            if (cp > 0xffff) {
+                cp -= 0x10000;
+                put_unit(out, fold->buf, &len, 0xd800 | (cp >> 10), enc, false);
+                put_unit(out, fold->buf, &len, 0xdc00 | (cp & 0x3ff), enc, false);
+            }
+            else {
+                put_unit(out, fold->buf, &len, (uint16_t)cp, enc, icase && cp < 0x80 && isalpha((int)cp));
+            }
+        }
+    }
+    fold->len = len;
+    return (struct data){len, out};
+}
+
+/* comma separated encoding names, returns the count or -1 */
+static int parse_encodings(const char *list, int *encs) {
+    int count = 0;
+    while (*list) {
+        size_t n = strcspn(list, ",");
+        int enc = -1;
+        for (int i = 0; i < MAX_ENCODINGS; i++)
+            if (strlen(encoding_names[i]) == n && strncmp(encoding_names[i], list, n) == 0)
+                enc = i;
+        if (enc < 0)
+            return -1;
+        bool seen = false;
+        for (int i = 0; i < count; i++)
+            seen = seen || encs[i] == enc;
+        if (!seen)
+            encs[count++] = enc;
+        list += n;
+        if (*list == ',')
+            list++;
+    }
+    return count;
+}
+
 int parse_arg(int argc, char **argv) {
     int error = 0;
     if (argc <= 1) {
@@ -69,6 +200,9 @@ int parse_arg(int argc, char **argv) {
     char **args = malloc(argc * sizeof(char*));
     char *range_str = NULL;
     bool string_mode = false;
+    bool icase = false;
+    int encs[MAX_ENCODINGS];
+    int num_encs = 0;
     // start from 1, skip the first
     for (int i = 1; i < argc; i++) {
         char *cur = argv[i];
@@ -78,6 +212,32 @@ int parse_arg(int argc, char **argv) {
                     string_mode = true;
                     continue;
                 }
+                if (strcmp("icase", cur + 2) == 0) {
+                    icase = true;
+                    continue;
+                }
+                if (strncmp("encoding=", cur + 2, 9) == 0) {
+                    num_encs = parse_encodings(cur + 11, encs);
+                    if (num_encs <= 0) {
+                        fprintf(stderr, "xsp: invalid encoding list '%s'\n", cur + 11);
+                        error = 1;
+                        goto exit;
+                    }
+                    continue;
+                }
+                if (strncmp("decompress=", cur + 2, 11) == 0) {
+                    const char *fmt = cur + 13;
+                    if (strcmp(fmt, "auto") == 0) decompress_mode = DECOMPRESS_AUTO;
+                    else if (strcmp(fmt, "gzip") == 0) decompress_mode = DECOMPRESS_GZIP;
+                    else if (strcmp(fmt, "zstd") == 0) decompress_mode = DECOMPRESS_ZSTD;
+                    else if (strcmp(fmt, "none") == 0) decompress_mode = DECOMPRESS_NONE;
+                    else {
+                        fprintf(stderr, "xsp: invalid decompress format '%s'\n", fmt);
+                        error = 1;
+                        goto exit;
+                    }
+                    continue;
+                }
                 if (strcmp("help", cur + 2) == 0) {
                     print_help = true;
                     goto exit;
@@ -86,6 +246,75 @@ int parse_arg(int argc, char **argv) {
                     benchmark_mode = true;
                     continue;
                 }
+                if (strcmp("unique-at", cur + 2) == 0) {
+                    char *end = NULL;
+                    if (i + 1 < argc)
+                        unique_at = strtoull(argv[i + 1], &end, 0);
+                    if (end == NULL || end == argv[i + 1] || *end != '\0') {
+                        fprintf(stderr, "xsp: invalid offset '%s'\n", i + 1 < argc ? argv[i + 1] : "");
+                        error = 1;
+                        goto exit;
+                    }
+                    unique_mode = true;
+                    i++;
+                    continue;
+                }
+                if (strcmp("window", cur + 2) == 0) {
+                    if (i + 1 >= argc || (window_size = parse_size(argv[i + 1])) == 0) {
+                        fprintf(stderr, "xsp: invalid window size '%s'\n", i + 1 < argc ? argv[i + 1] : "");
+                        error = 1;
+                        goto exit;
+                    }
+                    i++;
+                    continue;
+                }
+                if (strcmp("pid", cur + 2) == 0) {
+                    char *end = NULL;
+                    long pid = 0;
+                    if (i + 1 < argc)
+                        pid = strtol(argv[i + 1], &end, 10);
+                    if (end == NULL || end == argv[i + 1] || *end != '\0' || pid <= 0) {
+                        fprintf(stderr, "xsp: invalid pid '%s'\n", i + 1 < argc ? argv[i + 1] : "");
+                        error = 1;
+                        goto exit;
+                    }
+                    target_pid = (int)pid;
+                    i++;
+                    continue;
+                }
+                if (strcmp("cache", cur + 2) == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "xsp: --cache requires a directory\n");
+                        error = 1;
+                        goto exit;
+                    }
+                    cache_dir = argv[++i];
+                    continue;
+                }
+                if (strcmp("perm", cur + 2) == 0 || strcmp("region", cur + 2) == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "xsp: %s requires a value\n", cur);
+                        error = 1;
+                        goto exit;
+                    }
+                    if (cur[2] == 'p')
+                        region_perms = argv[++i];
+                    else
+                        region_name = argv[++i];
+                    continue;
+                }
+                if (strcmp("serve", cur + 2) == 0 || strcmp("connect", cur + 2) == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "xsp: %s requires a socket path\n", cur);
+                        error = 1;
+                        goto exit;
+                    }
+                    if (cur[2] == 's')
+                        serve_path = argv[++i];
+                    else
+                        connect_path = argv[++i];
+                    continue;
+                }
                 fprintf(stderr, "xsp: unkown long argument '%s'\n", cur);
                 error = 1;
                 goto exit;
@@ -138,12 +367,68 @@ int parse_arg(int argc, char **argv) {
         goto exit; // skip pattern validation for benchmark mode
     }
 
+    if (unique_mode) {
+        if (argsc > 0) {
+            fprintf(stderr, "xsp: --unique-at doesn't accept pattern arguments\n");
+            error = 1;
+        }
+        else if (file_path == NULL) {
+            fprintf(stderr, "xsp: --unique-at requires a file (-f <file>)\n");
+            error = 1;
+        }
+        goto exit;
+    }
+
+    // the daemon receives patterns with each request
+    if (serve_path != NULL) {
+        if (argsc > 0 || connect_path != NULL) {
+            fprintf(stderr, "xsp: serve mode doesn't accept pattern arguments\n");
+            error = 1;
+        }
+        goto exit;
+    }
+
     if (argsc < 1 || argsc > 2) {
         fprintf(stderr, "xsp: too less or too many arguments\n");
         error = 1;
         goto exit;
     }
 
+    // a process is read from its mappings instead of a file
+    if (target_pid > 0 && (file_path != NULL || connect_path != NULL || decompress_mode != DECOMPRESS_NONE)) {
+        fprintf(stderr, "xsp: --pid can't be combined with a file\n");
+        error = 1;
+        goto exit;
+    }
+    if (target_pid == 0 && (region_perms != NULL || region_name != NULL)) {
+        fprintf(stderr, "xsp: --perm and --region require --pid\n");
+        error = 1;
+        goto exit;
+    }
+
+    // cached results are keyed by the content of a local file
+    if (cache_dir != NULL && (argsc == 2 || connect_path != NULL || target_pid > 0 ||
+                              decompress_mode != DECOMPRESS_NONE)) {
+        fprintf(stderr, "xsp: --cache only supports local file searches\n");
+        error = 1;
+        goto exit;
+    }
+
+    // decompressed data only exists in memory, auto still patches plain files
+    if ((decompress_mode != DECOMPRESS_NONE && connect_path != NULL) ||
+        (decompress_mode > DECOMPRESS_AUTO && argsc == 2)) {
+        fprintf(stderr, "xsp: --decompress only supports local searches\n");
+        error = 1;
+        goto exit;
+    }
+
+    // the daemon scans its own long-lived mappings, it has no windows
+    if (window_size != 0 && connect_path != NULL) {
+        fprintf(stderr, "xsp: --window only supports local searches\n");
+        error = 1;
+        goto exit;
+    }
+
     hex1 = str2hex(args[0], string_mode);
     if (hex1.buf == NULL) {
         error = 1;
@@ -165,6 +450,35 @@ int parse_arg(int argc, char **argv) {
         }
     }
 
+    // expand strings into one search variant per encoding
+    if (icase || num_encs > 0) {
+        if (!string_mode) {
+            fprintf(stderr, "xsp: --icase and --encoding require --str\n");
+            free(hex1.buf);
+            free(hex2.buf);
+            error = 1;
+            goto exit;
+        }
+        if (num_encs == 0)
+            encs[num_encs++] = ENC_ASCII;
+        for (int i = 0; i < num_encs; i++) {
+            struct variant *var = &variants[num_variants++];
+            struct data unused;
+            var->name = encoding_names[encs[i]];
+            var->find = encode_str(args[0], encs[i], icase, &var->fold);
+            var->replace = (struct data){0, NULL};
+            if (argsc == 2) {
+                var->replace = encode_str(args[1], encs[i], false, &unused);
+                free(unused.buf);
+                if (var->replace.len != var->find.len) {
+                    fprintf(stderr, "xsp: string length mismatch in %s!\n", var->name);
+                    error = 1;
+                    goto exit;
+                }
+            }
+        }
+    }
+
     if (range_str != NULL) {
         if (sscanf(range_str, "%d,%d", &pat_range.left, &pat_range.right) != 2) {
             fprintf(stderr, "xsp: invalid range '%s'\n", range_str);
@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "private.h"
+#include "anchored_memchr/anchored_memchr.h"
+#include "pool/pool.h"
+
+#define DECOMP_BLOCK (4 * 1024 * 1024)
+#define DECOMP_SLOTS 8               // blocks decompressed ahead of the matcher
+#define DECOMP_INPUT (256 * 1024)
+#define MEMBER_MAX    (64 * 1024 * 1024)  // largest member decoded in one piece
+#define MEMBER_BUDGET (256 * 1024 * 1024) // decoded bytes held by members in flight
+
+/* streaming decoder over `fp`, one of the DECOMPRESS_* formats */
+typedef struct {
+    FILE *fp;
+    int format;
+    unsigned char *in;
+    size_t in_len, in_pos;
+    bool in_eof;
+    bool done;
+    bool started;
+    bool ended;                      // last frame or member was complete
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zd;
+#endif
+} decoder_t;
+
+/* one block of the decompressed stream and the search over it */
+typedef struct {
+    unsigned char *buf;              // block followed by the first bytes of the next one
+    size_t len;
+    size_t scan;                     // len plus the borrowed bytes
+    offset_t base;
+    const anchored_memchr_idx_t *idx;
+    offset_t *results;
+    int result_count;
+    pool_job_t job;
+} block_t;
+
+/* independently decodable piece of the input: a zstd frame or a BGZF block */
+typedef struct {
+    const unsigned char *src;
+    size_t src_len;
+    size_t size;                     // decompressed size from its header
+    int format;
+    bool error;
+    block_t block;
+    pool_job_t decode_job;
+} member_t;
+
+int compression_format(FILE *fp) {
+    unsigned char magic[4] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    rewind(fp);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return DECOMPRESS_GZIP;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return DECOMPRESS_ZSTD;
+    return DECOMPRESS_NONE;
+}
+
+static int decoder_init(decoder_t *d, FILE *fp, int format) {
+    memset(d, 0, sizeof(*d));
+    d->fp = fp;
+    d->format = format;
+    d->ended = true;
+    switch (format) {
+#ifdef HAVE_ZLIB
+        case DECOMPRESS_GZIP:
+            if (inflateInit2(&d->zs, 15 + 32) != Z_OK) // gzip or zlib header
+                return 1;
+            break;
+#endif
+#ifdef HAVE_ZSTD
+        case DECOMPRESS_ZSTD:
+            d->zd = ZSTD_createDStream();
+            if (d->zd == NULL || ZSTD_isError(ZSTD_initDStream(d->zd)))
+                return 1;
+            break;
+#endif
+        default:
+            fprintf(stderr, "xsp: %s support is not compiled in\n", format == DECOMPRESS_GZIP ? "gzip" : "zstd");
+            return 1;
+    }
+    d->in = malloc(DECOMP_INPUT);
+    return 0;
+}
+
+static void decoder_release(decoder_t *d) {
+#ifdef HAVE_ZLIB
+    if (d->format == DECOMPRESS_GZIP)
+        inflateEnd(&d->zs);
+#endif
+#ifdef HAVE_ZSTD
+    if (d->format == DECOMPRESS_ZSTD)
+        ZSTD_freeDStream(d->zd);
+#endif
+    free(d->in);
+}
+
+/* refill the input buffer once it is used up, false at end of file */
+static bool decoder_input(decoder_t *d) {
+    if (d->in_pos < d->in_len)
+        return true;
+    if (d->in_eof)
+        return false;
+    d->in_len = fread(d->in, 1, DECOMP_INPUT, d->fp);
+    d->in_pos = 0;
+    if (d->in_len < DECOMP_INPUT)
+        d->in_eof = true;
+    return d->in_len > 0;
+}
+
+/* keep at least `n` unread input bytes buffered, false when the file has fewer left */
+static bool decoder_peek(decoder_t *d, size_t n) {
+    size_t left = d->in_len - d->in_pos;
+    if (left < n && !d->in_eof) {
+        memmove(d->in, d->in + d->in_pos, left);
+        size_t got = fread(d->in + left, 1, DECOMP_INPUT - left, d->fp);
+        d->in_len = left + got;
+        d->in_pos = 0;
+        if (got < DECOMP_INPUT - left)
+            d->in_eof = true;
+        left = d->in_len;
+    }
+    return left >= n;
+}
+
+static inline bool gzip_magic(const unsigned char *p, size_t len) {
+    return len >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+/*
+fill `out` with up to `cap` decompressed bytes, less only at the end of the stream
+concatenated gzip members and zstd frames are read as one stream,
+anything after the last gzip member that is not another one is ignored like gzip does
+returns -1 on corrupt or truncated input
+*/
+static long decoder_read(decoder_t *d, unsigned char *out, size_t cap) {
+    size_t len = 0;
+    while (len < cap && !d->done) {
+        if (!decoder_input(d)) {
+            if (!d->ended) {
+                fprintf(stderr, "xsp: unexpected end of compressed input\n");
+                return -1;
+            }
+            d->done = true;
+            break;
+        }
+#ifdef HAVE_ZLIB
+        if (d->format == DECOMPRESS_GZIP) {
+            if (d->ended && d->started) {
+                if (!decoder_peek(d, 2) || !gzip_magic(d->in + d->in_pos, d->in_len - d->in_pos)) {
+                    d->done = true; // zero padding or trailing garbage
+                    break;
+                }
+                inflateReset(&d->zs); // next member
+            }
+            d->started = true;
+            d->ended = false;
+            d->zs.next_in = d->in + d->in_pos;
+            d->zs.avail_in = (uInt)(d->in_len - d->in_pos);
+            d->zs.next_out = out + len;
+            d->zs.avail_out = (uInt)(cap - len);
+            int ret = inflate(&d->zs, Z_NO_FLUSH);
+            d->in_pos = d->in_len - d->zs.avail_in;
+            len = cap - d->zs.avail_out;
+            if (ret == Z_STREAM_END) {
+                d->ended = true;
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "xsp: invalid gzip data\n");
+                return -1;
+            }
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (d->format == DECOMPRESS_ZSTD) {
+            ZSTD_inBuffer zin = {d->in, d->in_len, d->in_pos};
+            ZSTD_outBuffer zout = {out, cap, len};
+            size_t ret = ZSTD_decompressStream(d->zd, &zout, &zin);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "xsp: invalid zstd data: %s\n", ZSTD_getErrorName(ret));
+                return -1;
+            }
+            d->in_pos = zin.pos;
+            len = zout.pos;
+            d->ended = ret == 0;
+        }
+#endif
+    }
+    return (long)len;
+}
+
+static void block_worker(void *arg) {
+    block_t *b = (block_t *)arg;
+    int count = 0;
+    offset_t *local = anchored_memchr_match(b->idx, b->buf, b->buf + b->scan, &count);
+    // matches starting in the borrowed bytes belong to the next block
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (offset_of(local[i]) < (offset_t)b->len)
+            local[kept++] = b->base + local[i];
+    }
+    b->results = local;
+    b->result_count = kept;
+}
+
+/* append the results of `b` once its search has finished */
+static void collect_block(pool_t *pool, block_t *b, offset_t **offsets, size_t *matched, size_t *cap) {
+    if (pool != NULL)
+        pool_wait(pool, &b->job);
+    size_t n = (size_t)b->result_count;
+    if (n == 0) {
+        free(b->results);
+        return;
+    }
+    if (*matched + n > *cap) {
+        *cap = *matched + n > *cap * 2 ? *matched + n : *cap * 2;
+        *offsets = realloc(*offsets, *cap * sizeof(offset_t));
+    }
+    memcpy(*offsets + *matched, b->results, n * sizeof(offset_t));
+    *matched += n;
+    free(b->results);
+}
+
+static inline uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void add_member(member_t **members, size_t *n, size_t *cap, member_t m) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *members = realloc(*members, *cap * sizeof(member_t));
+    }
+    (*members)[(*n)++] = m;
+}
+
+/*
+split mapped input into members that can be decoded in parallel: zstd frames
+that record their content size, or BGZF blocks, which record theirs in the
+gzip extra field and trailer, returns 0 when the input can only be streamed
+*/
+static size_t split_members(const unsigned char *src, size_t len, int format, member_t **out) {
+    member_t *members = NULL;
+    size_t n = 0, cap = 0, off = 0;
+#ifdef HAVE_ZSTD
+    while (format == DECOMPRESS_ZSTD && off < len) {
+        size_t frame = ZSTD_findFrameCompressedSize(src + off, len - off);
+        if (ZSTD_isError(frame))
+            goto stream;
+        if (len - off >= 4 && (read_le32(src + off) & 0xfffffff0u) == 0x184d2a50u) {
+            off += frame; // skippable frame
+            continue;
+        }
+        unsigned long long size = ZSTD_getFrameContentSize(src + off, len - off);
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > MEMBER_MAX)
+            goto stream;
+        if (size > 0)
+            add_member(&members, &n, &cap, (member_t){
+                .src = src + off,
+                .src_len = frame,
+                .size = (size_t)size,
+                .format = format,
+            });
+        off += frame;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    while (format == DECOMPRESS_GZIP && off < len && gzip_magic(src + off, len - off)) {
+        const unsigned char *p = src + off;
+        size_t rest = len - off;
+        if (rest < 18 || p[2] != 8 || (p[3] & 4) == 0)
+            goto stream; // no extra field, not BGZF
+        size_t xlen = (size_t)p[10] | (size_t)p[11] << 8;
+        size_t block = 0;
+        for (size_t x = 12; x + 4 <= 12 + xlen && x + 6 <= rest;) {
+            size_t slen = (size_t)p[x + 2] | (size_t)p[x + 3] << 8;
+            if (p[x] == 'B' && p[x + 1] == 'C' && slen == 2)
+                block = ((size_t)p[x + 4] | (size_t)p[x + 5] << 8) + 1;
+            x += 4 + slen;
+        }
+        if (block < 12 + xlen + 8 || block > rest)
+            goto stream;
+        size_t size = read_le32(p + block - 4);
+        if (size > 0) // the empty block marks the end of file
+            add_member(&members, &n, &cap, (member_t){
+                .src = p,
+                .src_len = block,
+                .size = size,
+                .format = format,
+            });
+        off += block;
+    }
+#endif
+    if (n >= 2) {
+        *out = members;
+        return n;
+    }
+    goto stream; // a single member gains nothing
+stream:
+    free(members);
+    return 0;
+}
+
+static void member_worker(void *arg) {
+    member_t *m = (member_t *)arg;
+    size_t got = 0;
+    m->error = true;
+#ifdef HAVE_ZSTD
+    if (m->format == DECOMPRESS_ZSTD) {
+        size_t ret = ZSTD_decompress(m->block.buf, m->size, m->src, m->src_len);
+        got = ZSTD_isError(ret) ? 0 : ret;
+        m->error = ZSTD_isError(ret) || ret != m->size;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    if (m->format == DECOMPRESS_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) == Z_OK) {
+            zs.next_in = (Bytef *)(uintptr_t)m->src;
+            zs.avail_in = (uInt)m->src_len;
+            zs.next_out = m->block.buf;
+            zs.avail_out = (uInt)m->size;
+            int ret = inflate(&zs, Z_FINISH);
+            got = zs.total_out;
+            m->error = ret != Z_STREAM_END || got != m->size;
+            inflateEnd(&zs);
+        }
+    }
+#endif
+    m->block.len = got;
+}
+
+static void submit_member(pool_t *pool, member_t *m, const anchored_memchr_idx_t *idx, size_t overlap,
+                          size_t *held) {
+    m->block = (block_t){.buf = malloc(m->size + overlap), .idx = idx};
+    *held += m->size;
+    pool_submit(pool, &m->decode_job, member_worker, m);
+}
+
+/*
+members are decoded by the pool ahead of the matcher within MEMBER_BUDGET,
+each one is searched as soon as the heads of the following members complete its overlap
+*/
+static offset_t *search_members(pool_t *pool, member_t *m, size_t n, const anchored_memchr_idx_t *idx,
+                                size_t *count) {
+    const size_t overlap = idx->maxlen - 1;
+    size_t decoded = 0, searched = 0, collected = 0, held = 0;
+    size_t matched = 0, offcap = 0;
+    offset_t *offsets = NULL;
+    offset_t pos = 0;
+    bool error = false;
+
+    for (size_t i = 0; i < n; i++) {
+        while (decoded < n && (decoded < i + 2 || held + m[decoded].size <= MEMBER_BUDGET))
+            submit_member(pool, &m[decoded++], idx, overlap, &held);
+        pool_wait(pool, &m[i].decode_job);
+        if (m[i].error) {
+            error = true;
+            break;
+        }
+
+        // short members may need the heads of several followers
+        size_t borrow = 0;
+        for (size_t j = i + 1; j < n && borrow < overlap; j++) {
+            while (decoded <= j)
+                submit_member(pool, &m[decoded++], idx, overlap, &held);
+            pool_wait(pool, &m[j].decode_job);
+            size_t take = overlap - borrow < m[j].block.len ? overlap - borrow : m[j].block.len;
+            memcpy(m[i].block.buf + m[i].block.len + borrow, m[j].block.buf, take);
+            borrow += take;
+        }
+        m[i].block.scan = m[i].block.len + borrow;
+        m[i].block.base = pos;
+        pos += (offset_t)m[i].block.len;
+        pool_submit(pool, &m[i].block.job, block_worker, &m[i].block);
+        searched++;
+
+        // nothing borrows from a searched member any more, free it once over budget
+        while (collected < searched && held > MEMBER_BUDGET) {
+            collect_block(pool, &m[collected].block, &offsets, &matched, &offcap);
+            free(m[collected].block.buf);
+            held -= m[collected++].size;
+        }
+    }
+
+    while (collected < searched) {
+        collect_block(pool, &m[collected].block, &offsets, &matched, &offcap);
+        free(m[collected++].block.buf);
+    }
+    for (size_t k = searched; k < decoded; k++) {
+        pool_wait(pool, &m[k].decode_job);
+        free(m[k].block.buf);
+    }
+    if (error) {
+        fprintf(stderr, "xsp: invalid %s data\n", m[0].format == DECOMPRESS_GZIP ? "gzip" : "zstd");
+        free(offsets);
+        return NULL;
+    }
+    *count = matched;
+    return offsets != NULL ? offsets : (offset_t *)malloc(0);
+}
+
+/*
+search the decompressed stream of `fp` while it is being decompressed,
+input made of independent members is decoded in parallel by the pool,
+otherwise the calling thread decodes blocks ahead and the pool matches them
+offsets are positions in the decompressed stream, NULL on error
+*/
+offset_t *decompress_search(FILE *fp, int format, const anchored_memchr_idx_t *idx, size_t *count) {
+    *count = 0;
+    if (idx->plen == 0)
+        return (offset_t *)malloc(0);
+
+    pool_t *pool = num_threads == 1 ? NULL : get_search_pool();
+    struct stat st;
+    if (pool != NULL && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t len = (size_t)st.st_size;
+        unsigned char *src = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (src != MAP_FAILED) {
+            member_t *members;
+            size_t n = split_members(src, len, format, &members);
+            offset_t *offs = NULL;
+            if (n > 0) {
+                offs = search_members(pool, members, n, idx, count);
+                free(members);
+            }
+            munmap(src, len);
+            if (n > 0)
+                return offs;
+        }
+    }
+
+    decoder_t dec;
+    if (decoder_init(&dec, fp, format) != 0) {
+        decoder_release(&dec);
+        return NULL;
+    }
+
+    // a block at least as long as the overlap, so the next one alone completes it
+    const size_t overlap = idx->maxlen - 1;
+    const size_t block_len = overlap > DECOMP_BLOCK ? overlap : DECOMP_BLOCK;
+    block_t blocks[DECOMP_SLOTS];
+    for (int i = 0; i < DECOMP_SLOTS; i++) {
+        blocks[i] = (block_t){.buf = malloc(block_len + overlap), .idx = idx};
+    }
+
+    size_t matched = 0, offcap = 0;
+    offset_t *offsets = NULL;
+    size_t submitted = 0, collected = 0;
+    offset_t pos = 0;
+    int error = 0;
+
+    block_t *prev = NULL;
+    for (size_t seq = 0;; seq++) {
+        while (seq >= DECOMP_SLOTS && collected <= seq - DECOMP_SLOTS)
+            collect_block(pool, &blocks[collected++ % DECOMP_SLOTS], &offsets, &matched, &offcap);
+        block_t *cur = &blocks[seq % DECOMP_SLOTS];
+        long n = decoder_read(&dec, cur->buf, block_len);
+        if (n < 0) {
+            error = 1;
+            break;
+        }
+        cur->len = (size_t)n;
+        cur->base = pos;
+        pos += (offset_t)n;
+
+        // the previous block can be searched once it has the head of this one
+        if (prev != NULL) {
+            size_t borrow = cur->len < overlap ? cur->len : overlap;
+            memcpy(prev->buf + prev->len, cur->buf, borrow);
+            prev->scan = prev->len + borrow;
+            if (pool != NULL)
+                pool_submit(pool, &prev->job, block_worker, prev);
+            else
+                block_worker(prev);
+            submitted++;
+        }
+        if (cur->len == 0)
+            break;
+        prev = cur;
+    }
+    // blocks are collected in stream order so offsets stay sorted
+    while (collected < submitted)
+        collect_block(pool, &blocks[collected++ % DECOMP_SLOTS], &offsets, &matched, &offcap);
+
+    for (int i = 0; i < DECOMP_SLOTS; i++)
+        free(blocks[i].buf);
+    decoder_release(&dec);
+    if (error) {
+        free(offsets);
+        return NULL;
+    }
+    *count = matched;
+    return offsets != NULL ? offsets : (offset_t *)malloc(0);
+}
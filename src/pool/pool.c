@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;    // signaled when a job is queued
+    pthread_cond_t done_cv;    // broadcast when a job finishes
+    pool_job_t *head, *tail;
+    bool stop;
+    int nthreads;
+    pthread_t *tids;
+};
+
+static void *pool_worker(void *arg) {
+    pool_t *pool = (pool_t *)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->stop)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        if (pool->head == NULL)
+            break;
+        pool_job_t *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_broadcast(&pool->done_cv);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+pool_t *pool_create(int threads) {
+    if (threads < 1) threads = 1;
+    pool_t *pool = (pool_t *)malloc(sizeof(pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pool->head = pool->tail = NULL;
+    pool->stop = false;
+    pool->nthreads = 0;
+    pool->tids = (pthread_t *)malloc((size_t)threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->tids[pool->nthreads], NULL, pool_worker, pool) == 0)
+            pool->nthreads++;
+    }
+    if (pool->nthreads == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int pool_size(pool_t *pool) {
+    return pool->nthreads;
+}
+
+void pool_submit(pool_t *pool, pool_job_t *job, void (*fn)(void *), void *arg) {
+    job->fn = fn;
+    job->arg = arg;
+    job->done = false;
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool, pool_job_t *job) {
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done)
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->tids[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->done_cv);
+    free(pool->tids);
+    free(pool);
+}
@@ -0,0 +1,32 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stdbool.h>
+
+/*
+minimal fixed-size thread pool
+jobs are owned by the caller and must stay alive until pool_wait returns
+*/
+
+typedef struct pool pool_t;
+
+typedef struct pool_job {
+    void (*fn)(void *arg);
+    void *arg;
+    bool done;
+    struct pool_job *next;
+} pool_job_t;
+
+pool_t *pool_create(int threads);
+
+int pool_size(pool_t *pool);
+
+/* queue a job, jobs run in submission order */
+void pool_submit(pool_t *pool, pool_job_t *job, void (*fn)(void *), void *arg);
+
+/* block until `job` has finished */
+void pool_wait(pool_t *pool, pool_job_t *job);
+
+void pool_destroy(pool_t *pool);
+
+#endif
@@ -6,27 +6,125 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "anchored_memchr/anchored_memchr.h"
+#include "pool/pool.h"
+
 #define CHUNK_SIZE     (64 * 1024)
+#define MAX_ENCODINGS  3
+#define HASH_BLOCK     (64 * 1024)
+
+/* nanosecond timestamps of a struct stat */
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st).st_mtimespec)
+#define ST_CTIM(st) ((st).st_ctimespec)
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#define ST_CTIM(st) ((st).st_ctim)
+#endif
+
+enum DECOMPRESS {
+    DECOMPRESS_NONE,
+    DECOMPRESS_AUTO,
+    DECOMPRESS_GZIP,
+    DECOMPRESS_ZSTD
+};
 
 struct data {
     size_t len;
     uint8_t *buf;
 };
 
+/* one encoding of a --str pattern */
+struct variant {
+    const char *name;
+    struct data find;
+    struct data fold;      // 0x20 on bytes matched caselessly
+    struct data replace;
+};
+
 /* starts with 0, support negative index, ends with -1 */
 struct range {
     int left, right;
 };
 
+/* consumes matches in file order and patches them as they become final */
+typedef struct {
+    FILE *fp;
+    const struct data *hex; // replacement for each variant
+    int nhex;
+    struct range rg;       // range as given, may be negative
+    FILE *err;
+    int next;              // first index not yet considered
+    int patched;
+    int expected;          // set once the total is known
+    bool finished;
+    bool failed;
+} patch_stream_t;
+
+/* per-block hashes of a file, filled in by the scan that searches it */
+typedef struct {
+    uint64_t *blocks;      // one per HASH_BLOCK
+    size_t nblocks;
+    uint64_t size;
+    bool valid;            // every block was hashed
+} content_hash_t;
+
+/*
+identity of an unchanged file for the --cache pre-check, ctime catches
+writes that put the old mtime back, which no user can do for ctime
+*/
+typedef struct {
+    uint64_t dev, ino, size, mtime, mtime_nsec, ctime, ctime_nsec;
+} file_stamp_t;
+
 extern bool print_help;
 extern bool benchmark_mode;
 extern struct data hex1, hex2;
 extern char *file_path;
 extern struct range pat_range;
 extern int num_threads;
+extern char *serve_path;
+extern char *connect_path;
+extern size_t window_size;
+extern bool unique_mode;
+extern offset_t unique_at;
+extern struct variant variants[MAX_ENCODINGS];
+extern int num_variants;
+extern int decompress_mode;
+extern int target_pid;
+extern char *region_perms;
+extern char *region_name;
+extern char *cache_dir;
 
 void usage();
 int parse_arg(int argc, char **argv);
 void run_benchmark(FILE *fp);
 
+offset_t *hex_search_map(const anchored_memchr_idx_t *idx, unsigned char *map, size_t file_size, size_t *count,
+                         patch_stream_t *ps);
+void patch_stream_init(patch_stream_t *ps, FILE *fp, const struct data *hex, int nhex, struct range rg,
+                       FILE *err);
+void patch_stream_feed(patch_stream_t *ps, offset_t *offsets, size_t count, bool final);
+int finish_request(FILE *fp, const struct data *hex, int nhex, offset_t *offsets, size_t count,
+                   struct range rg, patch_stream_t *ps, FILE *out, FILE *err);
+int search_threads(unsigned char *map, size_t file_size);
+pool_t *get_search_pool();
+void search_pool_release();
+void catch_map_faults();
+
+int find_unique(FILE *fp, offset_t target);
+
+offset_t *process_search(int pid, const anchored_memchr_idx_t *idx, size_t *count);
+
+uint64_t block_hash(const unsigned char *data, size_t len);
+offset_t *cache_lookup(FILE *fp, const anchored_memchr_idx_t *idx, file_stamp_t *stamp, size_t *count);
+void cache_store(FILE *fp, const anchored_memchr_idx_t *idx, const file_stamp_t *stamp, const content_hash_t *ch,
+                 const offset_t *offsets, size_t count);
+
+int compression_format(FILE *fp);
+offset_t *decompress_search(FILE *fp, int format, const anchored_memchr_idx_t *idx, size_t *count);
+
+int serve_main(const char *path);
+int client_main(const char *path);
+
 #endif
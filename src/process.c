@@ -0,0 +1,290 @@
+#define _GNU_SOURCE // process_vm_readv
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#include "private.h"
+#include "anchored_memchr/anchored_memchr.h"
+#include "pool/pool.h"
+
+#define PID_BATCH  (4 * 1024 * 1024)   // bytes read by one process_vm_readv call
+#define PID_IOV    64                  // regions gathered into one call
+#define PID_SPARSE (1024 * 1024 * 1024) // anonymous mappings above this are skipped when mostly untouched
+
+typedef struct {
+    offset_t start, end;
+    unsigned long long inode;
+    size_t populated;               // Rss plus Swap, the whole mapping when smaps is unavailable
+} region_t;
+
+/* part of a mapping, matches must start before addr + len */
+typedef struct {
+    offset_t addr;
+    size_t len;
+    size_t read;                    // len plus the overlap into the rest of the mapping
+} segment_t;
+
+typedef struct {
+    int pid;
+    segment_t segs[PID_IOV];
+    int nseg;
+    size_t total;
+    unsigned char *buf;             // owned by the slot, reused by every batch it carries
+    size_t buf_cap;
+    const anchored_memchr_idx_t *idx;
+    offset_t *results;
+    int result_count;
+    int error;                      // errno when the process could not be read at all
+    pool_job_t job;
+} pid_task_t;
+
+#ifdef __linux__
+
+/*
+an untouched page of an anonymous mapping reads as zeros, so a huge one
+that is mostly untouched (an allocator arena, a sanitizer shadow) would
+costs a read of every zero page, these are left out unless --region is given
+*/
+static bool sparse_mapping(const region_t *r) {
+    size_t size = (size_t)(r->end - r->start);
+    return r->inode == 0 && size > PID_SPARSE && r->populated < size / 4 && region_name == NULL;
+}
+
+/*
+readable mappings of `pid` passing the --perm and --region filters,
+smaps adds how much of each one is populated
+*/
+static int read_maps(int pid, region_t **regions, size_t *n) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+    FILE *fp = fopen(path, "r");
+    bool smaps = fp != NULL;
+    if (fp == NULL) {
+        snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+        fp = fopen(path, "r");
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "xsp: cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    size_t cap = 64;
+    *regions = malloc(cap * sizeof(region_t));
+    *n = 0;
+    region_t *cur = NULL; // the mapping smaps fields belong to, NULL when filtered out
+    size_t skipped = 0;
+    char line[4096 + 128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long start, end, inode, kb;
+        char perms[8];
+        int name_at = 0;
+        if (sscanf(line, "%llx-%llx %7s %*s %*s %llu %n", &start, &end, perms, &inode, &name_at) < 4) {
+            if (cur != NULL && (sscanf(line, "Rss: %llu kB", &kb) == 1 || sscanf(line, "Swap: %llu kB", &kb) == 1))
+                cur->populated += (size_t)kb * 1024;
+            continue;
+        }
+        if (cur != NULL && sparse_mapping(cur)) {
+            skipped += (size_t)(cur->end - cur->start);
+            (*n)--;
+        }
+        cur = NULL;
+        char *name = line + name_at;
+        name[strcspn(name, "\n")] = '\0';
+
+        if (perms[0] != 'r' || end > OFFSET_MASK || strcmp(name, "[vvar]") == 0)
+            continue; // vsyscall lies above the offset bits
+        bool keep = true;
+        for (const char *p = region_perms; p != NULL && *p != '\0' && keep; p++)
+            keep = strchr(perms, *p) != NULL;
+        if (!keep || (region_name != NULL && strstr(name, region_name) == NULL))
+            continue;
+
+        if (*n == cap) {
+            cap *= 2;
+            *regions = realloc(*regions, cap * sizeof(region_t));
+        }
+        cur = &(*regions)[(*n)++];
+        *cur = (region_t){start, end, inode, smaps ? 0 : (size_t)(end - start)};
+    }
+    if (cur != NULL && sparse_mapping(cur)) {
+        skipped += (size_t)(cur->end - cur->start);
+        (*n)--;
+    }
+    fclose(fp);
+    if (skipped > 0)
+        fprintf(stderr, "xsp: skipped %zu MiB of mostly untouched anonymous mappings, --region \"\" scans them\n",
+                skipped >> 20);
+    return 0;
+}
+
+static void pid_worker(void *arg) {
+    pid_task_t *task = (pid_task_t *)arg;
+    if (task->total > task->buf_cap) {
+        free(task->buf);
+        task->buf = malloc(task->total);
+        task->buf_cap = task->total;
+    }
+    unsigned char *buf = task->buf;
+    struct iovec local[PID_IOV], remote[PID_IOV];
+    size_t got[PID_IOV];
+    size_t pos = 0;
+    for (int i = 0; i < task->nseg; i++) {
+        local[i] = (struct iovec){buf + pos, task->segs[i].read};
+        remote[i] = (struct iovec){(void *)(uintptr_t)task->segs[i].addr, task->segs[i].read};
+        pos += task->segs[i].read;
+    }
+
+    // one call for the whole batch, segments past the first unreadable page are retried alone
+    ssize_t n = process_vm_readv(task->pid, local, (unsigned long)task->nseg, remote,
+                                 (unsigned long)task->nseg, 0);
+    size_t done = n > 0 ? (size_t)n : 0;
+    if (n < 0 && (errno == EPERM || errno == ESRCH))
+        task->error = errno;
+    for (int i = 0; i < task->nseg && task->error == 0; i++) {
+        if (done >= task->segs[i].read) {
+            got[i] = task->segs[i].read;
+            done -= task->segs[i].read;
+            continue;
+        }
+        got[i] = done;
+        done = 0;
+        n = process_vm_readv(task->pid, &local[i], 1, &remote[i], 1, 0);
+        if (n > 0)
+            got[i] = (size_t)n;
+        else if (n < 0 && (errno == EPERM || errno == ESRCH))
+            task->error = errno;
+    }
+
+    size_t matched = 0, cap = 0;
+    offset_t *results = NULL;
+    pos = 0;
+    for (int i = 0; i < task->nseg && task->error == 0; i++) {
+        int count = 0;
+        offset_t *local_offs = anchored_memchr_match(task->idx, buf + pos, buf + pos + got[i], &count);
+        if (matched + (size_t)count > cap) {
+            cap = matched + (size_t)count;
+            results = realloc(results, cap * sizeof(offset_t));
+        }
+        for (int k = 0; k < count; k++) {
+            if (offset_of(local_offs[k]) < (offset_t)task->segs[i].len)
+                results[matched++] = task->segs[i].addr + local_offs[k];
+        }
+        free(local_offs);
+        pos += task->segs[i].read;
+    }
+    task->results = results;
+    task->result_count = (int)matched;
+}
+
+/* append the results of `task` once it has finished, errors are kept in `error` */
+static void collect_task(pool_t *pool, pid_task_t *task, offset_t **offsets, size_t *matched, size_t *cap,
+                         int *error) {
+    if (pool != NULL)
+        pool_wait(pool, &task->job);
+    if (task->error != 0)
+        *error = task->error;
+    size_t n = (size_t)task->result_count;
+    if (*matched + n > *cap) {
+        *cap = *matched + n > *cap * 2 ? *matched + n : *cap * 2;
+        *offsets = realloc(*offsets, *cap * sizeof(offset_t));
+    }
+    memcpy(*offsets + *matched, task->results, n * sizeof(offset_t));
+    *matched += n;
+    free(task->results);
+    task->results = NULL;
+}
+
+/*
+search the readable memory of `pid`, mappings are read in batches of
+PID_BATCH bytes by the search pool, a ring of two slots per worker
+bounds the batches in flight and the buffers they read into,
+offsets are virtual addresses
+NULL when the process cannot be read
+*/
+offset_t *process_search(int pid, const anchored_memchr_idx_t *idx, size_t *count) {
+    *count = 0;
+    if (idx->plen == 0)
+        return (offset_t *)malloc(0);
+    region_t *regions;
+    size_t nregions;
+    if (read_maps(pid, &regions, &nregions) != 0)
+        return NULL;
+
+    pool_t *pool = num_threads == 1 ? NULL : get_search_pool();
+    const size_t nslots = pool != NULL ? 2 * (size_t)pool_size(pool) : 1;
+    pid_task_t *slots = malloc(nslots * sizeof(pid_task_t));
+    for (size_t i = 0; i < nslots; i++)
+        slots[i] = (pid_task_t){.pid = pid, .idx = idx};
+
+    // split mappings into batches, small mappings share one call
+    // batches are collected in address order so offsets stay sorted
+    const size_t overlap = idx->maxlen - 1;
+    size_t matched = 0, offcap = 0;
+    offset_t *offsets = NULL;
+    size_t submitted = 0, collected = 0;
+    int error = 0;
+    pid_task_t *cur = NULL;
+    for (size_t r = 0; r < nregions && error == 0; r++) {
+        offset_t end = regions[r].end;
+        for (offset_t addr = regions[r].start; addr < end && error == 0; addr += PID_BATCH) {
+            size_t len = end - addr < PID_BATCH ? (size_t)(end - addr) : PID_BATCH;
+            size_t read = end - addr < len + overlap ? (size_t)(end - addr) : len + overlap;
+            if (cur == NULL || cur->nseg == PID_IOV || cur->total + read > PID_BATCH + overlap) {
+                if (cur != NULL) {
+                    if (pool != NULL)
+                        pool_submit(pool, &cur->job, pid_worker, cur);
+                    else
+                        pid_worker(cur);
+                    submitted++;
+                }
+                if (submitted - collected == nslots)
+                    collect_task(pool, &slots[collected++ % nslots], &offsets, &matched, &offcap, &error);
+                cur = &slots[submitted % nslots];
+                cur->nseg = 0;
+                cur->total = 0;
+                cur->error = 0;
+            }
+            cur->segs[cur->nseg++] = (segment_t){addr, len, read};
+            cur->total += read;
+        }
+    }
+    free(regions);
+    if (cur != NULL && error == 0) {
+        if (pool != NULL)
+            pool_submit(pool, &cur->job, pid_worker, cur);
+        else
+            pid_worker(cur);
+        submitted++;
+    }
+    while (collected < submitted)
+        collect_task(pool, &slots[collected++ % nslots], &offsets, &matched, &offcap, &error);
+    for (size_t i = 0; i < nslots; i++)
+        free(slots[i].buf);
+    free(slots);
+
+    if (error != 0) {
+        fprintf(stderr, "xsp: cannot read memory of process %d: %s\n", pid, strerror(error));
+        free(offsets);
+        return NULL;
+    }
+    *count = matched;
+    return offsets != NULL ? offsets : (offset_t *)malloc(0);
+}
+
+#else
+
+offset_t *process_search(int pid, const anchored_memchr_idx_t *idx, size_t *count) {
+    (void)pid;
+    (void)idx;
+    *count = 0;
+    fprintf(stderr, "xsp: --pid is only supported on Linux\n");
+    return NULL;
+}
+
+#endif
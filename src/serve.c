@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "private.h"
+
+/*
+search daemon over a unix domain socket
+
+every message is a frame: uint32 payload length followed by the payload
+request payload:  struct req_header, path, hex1, hex2 (patch only)
+response payload: int32 status, uint32 stdout length, stdout text, stderr text
+*/
+
+#define MAP_CACHE_SIZE      64
+#define PATTERN_CACHE_SIZE  64
+#define MAX_REQUEST_SIZE    (16 * 1024 * 1024)
+#define MAX_CONNECTIONS     256
+#define CONN_TIMEOUT        30  // seconds a client may stay silent or stop reading
+
+enum REQUEST {
+    REQ_SEARCH,
+    REQ_PATCH
+};
+
+struct req_header {
+    uint32_t op;
+    int32_t left, right;
+    uint32_t path_len;
+    uint32_t pat_len;
+};
+
+struct mapped_file {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned char *map;
+    unsigned long last_used;
+    int refs;               // the cache's own reference plus one per request using it
+};
+
+struct compiled_pattern {
+    struct data hex;
+    anchored_memchr_idx_t idx;
+    unsigned long last_used;
+    int refs;
+};
+
+static struct mapped_file *map_cache[MAP_CACHE_SIZE];
+static struct compiled_pattern *pattern_cache[PATTERN_CACHE_SIZE];
+static unsigned long cache_clock = 0;
+static const char *socket_path = NULL;
+
+/*
+every connection has its own thread so an idle client stalls nobody,
+cache_lock is only held to look up, pin and unpin cache entries,
+an evicted entry stays alive until the last request using it lets go
+*/
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int active_connections = 0;
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        if (n == 0) return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, const void *payload, uint32_t len) {
+    if (write_all(fd, &len, sizeof(len)))
+        return 1;
+    return write_all(fd, payload, len);
+}
+
+/* returns malloc'ed payload, NULL on eof or error */
+static uint8_t *recv_frame(int fd, uint32_t *len, uint32_t limit) {
+    if (read_all(fd, len, sizeof(*len)))
+        return NULL;
+    if (*len > limit)
+        return NULL;
+    uint8_t *payload = malloc((size_t)*len + 1);
+    if (payload == NULL)
+        return NULL;
+    if (read_all(fd, payload, *len)) {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+/* with cache_lock held */
+static void map_release(struct mapped_file *mf) {
+    if (--mf->refs > 0)
+        return;
+    if (mf->map != NULL)
+        munmap(mf->map, (size_t)mf->size);
+    free(mf->path);
+    free(mf);
+}
+
+/*
+keep files mapped between requests, remap when the inode or mtime changes
+the entry is returned pinned, hand it back with map_release
+*/
+static struct mapped_file *map_cache_get(const char *path, FILE *err) {
+    // stamp and mapping both come from this fd, so they describe the same inode
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(err, "xsp: %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int slot = 0;
+    for (int i = 0; i < MAP_CACHE_SIZE; i++) {
+        struct mapped_file *mf = map_cache[i];
+        if (mf != NULL && strcmp(mf->path, path) == 0) {
+            if (mf->dev == st.st_dev && mf->ino == st.st_ino && mf->size == st.st_size &&
+                mf->mtime.tv_sec == ST_MTIM(st).tv_sec &&
+                mf->mtime.tv_nsec == ST_MTIM(st).tv_nsec) {
+                mf->last_used = ++cache_clock;
+                mf->refs++;
+                pthread_mutex_unlock(&cache_lock);
+                close(fd);
+                return mf;
+            }
+            slot = i;
+            break;
+        }
+        if (map_cache[slot] != NULL && (mf == NULL || mf->last_used < map_cache[slot]->last_used))
+            slot = i;
+    }
+    if (map_cache[slot] != NULL) {
+        map_release(map_cache[slot]);
+        map_cache[slot] = NULL;
+    }
+
+    struct mapped_file *mf = NULL;
+    unsigned char *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(err, "xsp: mmap %s: %s\n", path, strerror(errno));
+            close(fd);
+            goto exit;
+        }
+    }
+    close(fd);
+
+    mf = (struct mapped_file *)malloc(sizeof(struct mapped_file));
+    mf->path = strdup(path);
+    mf->dev = st.st_dev;
+    mf->ino = st.st_ino;
+    mf->size = st.st_size;
+    mf->mtime = ST_MTIM(st);
+    mf->map = map;
+    mf->last_used = ++cache_clock;
+    mf->refs = 2;
+    map_cache[slot] = mf;
+exit:
+    pthread_mutex_unlock(&cache_lock);
+    return mf;
+}
+
+/* with cache_lock held */
+static void pattern_release(struct compiled_pattern *cp) {
+    if (--cp->refs > 0)
+        return;
+    anchored_memchr_release(&cp->idx);
+    free(cp->hex.buf);
+    free(cp);
+}
+
+/* returned pinned, hand it back with pattern_release */
+static struct compiled_pattern *pattern_cache_get(struct data hex) {
+    pthread_mutex_lock(&cache_lock);
+    int slot = 0;
+    for (int i = 0; i < PATTERN_CACHE_SIZE; i++) {
+        struct compiled_pattern *cp = pattern_cache[i];
+        if (cp != NULL && cp->hex.len == hex.len && memcmp(cp->hex.buf, hex.buf, hex.len) == 0) {
+            cp->last_used = ++cache_clock;
+            cp->refs++;
+            pthread_mutex_unlock(&cache_lock);
+            return cp;
+        }
+        if (pattern_cache[slot] != NULL && (cp == NULL || cp->last_used < pattern_cache[slot]->last_used))
+            slot = i;
+    }
+    if (pattern_cache[slot] != NULL)
+        pattern_release(pattern_cache[slot]);
+
+    struct compiled_pattern *cp = (struct compiled_pattern *)malloc(sizeof(struct compiled_pattern));
+    cp->hex.len = hex.len;
+    cp->hex.buf = malloc(hex.len);
+    memcpy(cp->hex.buf, hex.buf, hex.len);
+    anchored_memchr_init(&cp->idx, hex.len, hex.buf);
+    cp->last_used = ++cache_clock;
+    cp->refs = 2;
+    pattern_cache[slot] = cp;
+    pthread_mutex_unlock(&cache_lock);
+    return cp;
+}
+
+static int handle_request(const uint8_t *payload, uint32_t len, FILE *out, FILE *err) {
+    struct req_header hdr;
+    if (len < sizeof(hdr)) {
+        fprintf(err, "xsp: malformed request\n");
+        return 1;
+    }
+    memcpy(&hdr, payload, sizeof(hdr));
+    size_t pats = hdr.op == REQ_PATCH ? 2 : 1;
+    if (hdr.op > REQ_PATCH || hdr.path_len == 0 || hdr.pat_len == 0 ||
+        (size_t)len != sizeof(hdr) + hdr.path_len + pats * hdr.pat_len) {
+        fprintf(err, "xsp: malformed request\n");
+        return 1;
+    }
+
+    const uint8_t *p = payload + sizeof(hdr);
+    char *path = malloc(hdr.path_len + 1);
+    memcpy(path, p, hdr.path_len);
+    path[hdr.path_len] = '\0';
+    p += hdr.path_len;
+    struct data pat1 = {hdr.pat_len, (uint8_t *)p};
+    struct data pat2 = {0, NULL};
+    if (hdr.op == REQ_PATCH)
+        pat2 = (struct data){hdr.pat_len, (uint8_t *)p + hdr.pat_len};
+    struct range rg = {hdr.left, hdr.right};
+
+    int error = 1;
+    FILE *fp = NULL;
+    offset_t *offs = NULL;
+    size_t count = 0;
+    struct mapped_file *mf = map_cache_get(path, err);
+    if (mf == NULL)
+        goto exit;
+    if (hdr.op == REQ_PATCH) {
+        fp = fopen(path, "rb+");
+        if (fp == NULL) {
+            fprintf(err, "xsp: %s: %s\n", path, strerror(errno));
+            goto exit;
+        }
+    }
+
+    // the scan runs unlocked, the pinned entries can't be unmapped under it
+    patch_stream_t ps;
+    if (fp != NULL)
+        patch_stream_init(&ps, fp, &pat2, 1, rg, err);
+    struct compiled_pattern *cp = pattern_cache_get(pat1);
+    offs = hex_search_map(&cp->idx, mf->map, (size_t)mf->size, &count, fp != NULL ? &ps : NULL);
+    if (offs == NULL) {
+        // only a fault on the mapping fails a scan here, the file shrank under it
+        fprintf(err, "xsp: %s changed while it was being searched\n", path);
+        if (fp != NULL && ps.patched > 0)
+            fprintf(out, "%d matches patched before the error\n", ps.patched);
+    }
+    else {
+        error = finish_request(fp, fp != NULL ? &pat2 : NULL, 1, offs, count, rg,
+                               fp != NULL ? &ps : NULL, out, err);
+    }
+    pthread_mutex_lock(&cache_lock);
+    pattern_release(cp);
+    pthread_mutex_unlock(&cache_lock);
+
+exit:
+    if (mf != NULL) {
+        pthread_mutex_lock(&cache_lock);
+        map_release(mf);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    if (fp != NULL)
+        fclose(fp);
+    free(offs);
+    free(path);
+    return error;
+}
+
+static void serve_connection(int conn) {
+    uint32_t len;
+    uint8_t *payload;
+    while ((payload = recv_frame(conn, &len, MAX_REQUEST_SIZE)) != NULL) {
+        char *out_buf = NULL, *err_buf = NULL;
+        size_t out_len = 0, err_len = 0;
+        FILE *out = open_memstream(&out_buf, &out_len);
+        FILE *err = open_memstream(&err_buf, &err_len);
+        int32_t status = handle_request(payload, len, out, err);
+        fclose(out);
+        fclose(err);
+        free(payload);
+
+        uint32_t resp_len = (uint32_t)(sizeof(int32_t) + sizeof(uint32_t) + out_len + err_len);
+        uint8_t *resp = malloc(resp_len);
+        uint32_t out_len32 = (uint32_t)out_len;
+        memcpy(resp, &status, sizeof(status));
+        memcpy(resp + sizeof(status), &out_len32, sizeof(out_len32));
+        memcpy(resp + sizeof(status) + sizeof(out_len32), out_buf, out_len);
+        memcpy(resp + sizeof(status) + sizeof(out_len32) + out_len, err_buf, err_len);
+        int failed = send_frame(conn, resp, resp_len);
+        free(resp);
+        free(out_buf);
+        free(err_buf);
+        if (failed)
+            break;
+    }
+}
+
+static void *connection_thread(void *arg) {
+    int conn = (int)(intptr_t)arg;
+    serve_connection(conn);
+    close(conn);
+    pthread_mutex_lock(&conn_lock);
+    active_connections--;
+    pthread_mutex_unlock(&conn_lock);
+    return NULL;
+}
+
+static void on_terminate(int sig) {
+    (void)sig;
+    if (socket_path != NULL)
+        unlink(socket_path);
+    _exit(0);
+}
+
+static int make_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "xsp: socket path too long '%s'\n", path);
+        return 1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int serve_main(const char *path) {
+    struct sockaddr_un addr;
+    if (make_address(&addr, path))
+        return 1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        close(sock);
+        return 1;
+    }
+    if (listen(sock, 16) != 0) {
+        perror("listen");
+        close(sock);
+        unlink(path);
+        return 1;
+    }
+    socket_path = path;
+    catch_map_faults();
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_terminate);
+    signal(SIGTERM, on_terminate);
+
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        struct timeval timeout = {CONN_TIMEOUT, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&conn_lock);
+        bool full = active_connections >= MAX_CONNECTIONS;
+        if (!full)
+            active_connections++;
+        pthread_mutex_unlock(&conn_lock);
+        pthread_t thread;
+        if (full || pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)conn) != 0) {
+            if (!full) {
+                pthread_mutex_lock(&conn_lock);
+                active_connections--;
+                pthread_mutex_unlock(&conn_lock);
+            }
+            close(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(sock);
+    unlink(path);
+    return 1;
+}
+
+int client_main(const char *path) {
+    struct sockaddr_un addr;
+    if (make_address(&addr, path))
+        return 1;
+    if (file_path == NULL) {
+        fprintf(stderr, "xsp: no file specified (-f <file>)\n");
+        return 1;
+    }
+    // the daemon has its own working directory
+    char abs_path[PATH_MAX];
+    if (realpath(file_path, abs_path) == NULL) {
+        perror("realpath");
+        return 1;
+    }
+
+    struct req_header hdr = {
+        .op = hex2.buf == NULL ? REQ_SEARCH : REQ_PATCH,
+        .left = pat_range.left,
+        .right = pat_range.right,
+        .path_len = (uint32_t)strlen(abs_path),
+        .pat_len = (uint32_t)hex1.len,
+    };
+    size_t pats = hdr.op == REQ_PATCH ? 2 : 1;
+    uint32_t len = (uint32_t)(sizeof(hdr) + hdr.path_len + pats * hdr.pat_len);
+    uint8_t *payload = malloc(len);
+    uint8_t *p = payload;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, abs_path, hdr.path_len);
+    p += hdr.path_len;
+    memcpy(p, hex1.buf, hex1.len);
+    if (hdr.op == REQ_PATCH)
+        memcpy(p + hex1.len, hex2.buf, hex2.len);
+
+    int error = 1;
+    uint8_t *resp = NULL;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        goto exit;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        goto exit;
+    }
+    // a daemon that hangs up is reported below instead of killing the client
+    signal(SIGPIPE, SIG_IGN);
+    if (send_frame(sock, payload, len) != 0 ||
+        (resp = recv_frame(sock, &len, UINT32_MAX)) == NULL) {
+        fprintf(stderr, "xsp: lost connection to '%s'\n", path);
+        goto exit;
+    }
+
+    int32_t status;
+    uint32_t out_len;
+    if (len < sizeof(status) + sizeof(out_len)) {
+        fprintf(stderr, "xsp: malformed response\n");
+        goto exit;
+    }
+    memcpy(&status, resp, sizeof(status));
+    memcpy(&out_len, resp + sizeof(status), sizeof(out_len));
+    size_t text_len = len - sizeof(status) - sizeof(out_len);
+    if (out_len > text_len) {
+        fprintf(stderr, "xsp: malformed response\n");
+        goto exit;
+    }
+    const uint8_t *text = resp + sizeof(status) + sizeof(out_len);
+    fwrite(text, 1, out_len, stdout);
+    fwrite(text + out_len, 1, text_len - out_len, stderr);
+    error = status;
+
+exit:
+    if (sock >= 0)
+        close(sock);
+    free(resp);
+    free(payload);
+    return error;
+}
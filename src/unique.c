@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "private.h"
+#include "pool/pool.h"
+
+/*
+shortest unique signature around an offset, in one pass over the file
+
+for every candidate start s near the target, m(s) is the longest prefix that
+file[s..] shares with any other position, a window [s, s + len) is unique
+exactly when len > m(s). each worker takes a slice of positions p and extends
+matches against an index of the 2-byte keys around the target.
+
+a pair (s, p) with file[s - 1] == file[p - 1] continues the match of
+(s - 1, p - 1) and is skipped, m(s) >= m(s - 1) - 1 is applied after merging.
+matches are measured up to LCP_CAP so that this still holds for the whole
+region, starts reaching it are dropped from the index
+*/
+
+#define UNIQUE_MAX_LEN  256
+#define LCP_CAP         (2 * UNIQUE_MAX_LEN)
+#define KEY_BITS        12
+#define KEY_SIZE        (1 << KEY_BITS)
+#define NO_ENTRY        -1
+
+#define key_of(p) ((unsigned)(((p)[0] << 8 | (p)[1]) * 40503u) >> (16 - KEY_BITS) & (KEY_SIZE - 1))
+
+typedef struct {
+    const unsigned char *map;
+    size_t file_size;
+    size_t region;             // first candidate start
+    size_t region_len;         // number of candidate starts
+    size_t from, to;           // positions scanned by this task
+    int *head;                 // KEY_SIZE bucket heads, first group of the bucket
+    int *group_prev;           // per group, byte before its starts, -1 for none
+    int *group_first;          // per group, first start
+    int *group_next;           // per group, next group in the bucket
+    int *group;                // per start, its group
+    int *next;                 // per start, next start in the group
+    int *prev;
+    size_t *lcp;               // per start, longest match found so far
+    size_t hist[256];          // byte counts of [from, to)
+    pool_job_t job;
+} unique_task_t;
+
+static size_t common_prefix(const unsigned char *a, const unsigned char *b, size_t limit) {
+    size_t n = 0;
+    while (n + 8 <= limit && memcmp(a + n, b + n, 8) == 0)
+        n += 8;
+    while (n < limit && a[n] == b[n])
+        n++;
+    return n;
+}
+
+static void unlink_start(unique_task_t *task, int s) {
+    if (task->prev[s] != NO_ENTRY)
+        task->next[task->prev[s]] = task->next[s];
+    else
+        task->group_first[task->group[s]] = task->next[s];
+    if (task->next[s] != NO_ENTRY)
+        task->prev[task->next[s]] = task->prev[s];
+}
+
+static void unique_worker(void *arg) {
+    unique_task_t *task = (unique_task_t *)arg;
+    const unsigned char *map = task->map;
+    const size_t size = task->file_size;
+
+    /*
+    index every candidate start that has at least 2 bytes left,
+    starts of a bucket are grouped by the byte before them
+    */
+    int groups = 0;
+    for (int k = 0; k < KEY_SIZE; k++)
+        task->head[k] = NO_ENTRY;
+    for (size_t i = task->region_len; i-- > 0;) {
+        size_t s = task->region + i;
+        task->lcp[i] = 0;
+        task->next[i] = task->prev[i] = NO_ENTRY;
+        if (s + 2 > size)
+            continue;
+        unsigned key = key_of(map + s);
+        int before = i > 0 ? map[s - 1] : -1;
+        int g = task->head[key];
+        while (g != NO_ENTRY && task->group_prev[g] != before)
+            g = task->group_next[g];
+        if (g == NO_ENTRY) {
+            g = groups++;
+            task->group_prev[g] = before;
+            task->group_first[g] = NO_ENTRY;
+            task->group_next[g] = task->head[key];
+            task->head[key] = g;
+        }
+        task->group[i] = g;
+        task->next[i] = task->group_first[g];
+        if (task->group_first[g] != NO_ENTRY)
+            task->prev[task->group_first[g]] = (int)i;
+        task->group_first[g] = (int)i;
+    }
+
+    memset(task->hist, 0, sizeof(task->hist));
+    for (size_t p = task->from; p < task->to; p++) {
+        task->hist[map[p]]++;
+        if (p + 2 > size)
+            continue;
+        int before = p > 0 ? map[p - 1] : -2;
+        for (int g = task->head[key_of(map + p)]; g != NO_ENTRY; g = task->group_next[g]) {
+            if (task->group_prev[g] == before)
+                continue; // continuations of pairs already measured
+            for (int i = task->group_first[g]; i != NO_ENTRY;) {
+                int nxt = task->next[i];
+                size_t s = task->region + (size_t)i;
+                if (s != p) {
+                    size_t limit = size - (s > p ? s : p);
+                    if (limit > LCP_CAP) limit = LCP_CAP;
+                    size_t n = common_prefix(map + s, map + p, limit);
+                    if (n > task->lcp[i])
+                        task->lcp[i] = n;
+                    if (n == LCP_CAP || n == size - s)
+                        unlink_start(task, i);
+                }
+                i = nxt;
+            }
+        }
+    }
+}
+
+static void print_hex(FILE *out, const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%02x", buf[i]);
+    fputc('\n', out);
+}
+
+int find_unique(FILE *fp, offset_t target) {
+    fseek(fp, 0, SEEK_END);
+    long file_size_long = ftell(fp);
+    rewind(fp);
+    if (file_size_long <= 0 || (offset_t)file_size_long <= target) {
+        fprintf(stderr, "xsp: offset 0x%llx is outside of the file\n", target);
+        return 1;
+    }
+    size_t file_size = (size_t)file_size_long;
+    unsigned char *map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    size_t region = target >= UNIQUE_MAX_LEN - 1 ? (size_t)target - (UNIQUE_MAX_LEN - 1) : 0;
+    size_t region_len = (size_t)target - region + 1;
+
+    int threads = search_threads(map, file_size);
+    pool_t *pool = threads > 1 ? get_search_pool() : NULL;
+    if (pool == NULL)
+        threads = 1;
+    else if (threads > pool_size(pool))
+        threads = pool_size(pool);
+
+    unique_task_t *tasks = (unique_task_t *)malloc((size_t)threads * sizeof(unique_task_t));
+    size_t slice = file_size / (size_t)threads;
+    for (int t = 0; t < threads; t++) {
+        unique_task_t *task = &tasks[t];
+        task->map = map;
+        task->file_size = file_size;
+        task->region = region;
+        task->region_len = region_len;
+        task->from = (size_t)t * slice;
+        task->to = t == threads - 1 ? file_size : task->from + slice;
+        task->head = (int *)malloc(KEY_SIZE * sizeof(int));
+        task->group_prev = (int *)malloc(region_len * sizeof(int));
+        task->group_first = (int *)malloc(region_len * sizeof(int));
+        task->group_next = (int *)malloc(region_len * sizeof(int));
+        task->group = (int *)malloc(region_len * sizeof(int));
+        task->next = (int *)malloc(region_len * sizeof(int));
+        task->prev = (int *)malloc(region_len * sizeof(int));
+        task->lcp = (size_t *)malloc(region_len * sizeof(size_t));
+        if (pool != NULL)
+            pool_submit(pool, &task->job, unique_worker, task);
+        else
+            unique_worker(task);
+    }
+
+    // merge: m(s) is the longest match seen by any worker
+    size_t hist[256] = {0};
+    size_t *lcp = (size_t *)calloc(region_len, sizeof(size_t));
+    for (int t = 0; t < threads; t++) {
+        unique_task_t *task = &tasks[t];
+        if (pool != NULL)
+            pool_wait(pool, &task->job);
+        for (size_t i = 0; i < region_len; i++)
+            if (task->lcp[i] > lcp[i]) lcp[i] = task->lcp[i];
+        for (int c = 0; c < 256; c++)
+            hist[c] += task->hist[c];
+        free(task->head);
+        free(task->group_prev);
+        free(task->group_first);
+        free(task->group_next);
+        free(task->group);
+        free(task->next);
+        free(task->prev);
+        free(task->lcp);
+    }
+    free(tasks);
+    for (size_t i = 1; i < region_len; i++)
+        if (lcp[i - 1] > lcp[i] + 1) lcp[i] = lcp[i - 1] - 1;
+
+    // shortest window, ties go to the one starting closest to the target
+    size_t best_start = 0, best_len = 0;
+    for (size_t i = region_len; i-- > 0;) {
+        size_t s = region + i;
+        size_t m = lcp[i];
+        if (m == 0 && hist[map[s]] > 1)
+            m = 1;
+        size_t len = m + 1;
+        if (len < (size_t)target - s + 1)
+            len = (size_t)target - s + 1;
+        if (len > UNIQUE_MAX_LEN || s + len > file_size)
+            continue;
+        if (best_len == 0 || len < best_len) {
+            best_start = s;
+            best_len = len;
+        }
+    }
+    free(lcp);
+
+    int error = 0;
+    if (best_len == 0) {
+        printf("no unique signature up to %d bytes covers 0x%llx\n", UNIQUE_MAX_LEN, target);
+        error = 1;
+    }
+    else {
+        printf("0x%zx: ", best_start);
+        print_hex(stdout, map + best_start, best_len);
+        printf("%zu bytes unique, target at +%zu\n", best_len, (size_t)target - best_start);
+    }
+    munmap(map, file_size);
+    return error;
+}
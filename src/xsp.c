@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,13 +7,18 @@
 #include <time.h>
 #include <sys/time.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "private.h"
 #include "anchored_memchr/anchored_memchr.h"
+#include "pool/pool.h"
 
 enum MODE {
     SEARCH_MODE,
@@ -19,10 +26,24 @@ enum MODE {
 } mode;
 
 #define STEP_SIZE       256
+#define TASKS_PER_THREAD 4
+#define MIN_TASK_SIZE   (1024 * 1024)
+#define PATCH_BATCH     (64 * 1024)
+#define DEFAULT_WINDOW  (1024UL * 1024 * 1024)
+#define MIN_THREAD_BYTES (2 * 1024 * 1024)
+#define COLD_THREADS    4
+#define RESIDENCY_SAMPLES 64
+#define MIN_HOLE_SKIP   (1024 * 1024)
+
+#ifdef __APPLE__
+typedef char mincore_vec_t;
+#else
+typedef unsigned char mincore_vec_t;
+#endif
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
-static inline int update_range(struct range *rg, size_t total) {
+static inline int update_range(struct range *rg, size_t total, FILE *err) {
     /* 
     convert negative range to positive one
     return 1 if succeed
@@ -37,60 +58,167 @@ static inline int update_range(struct range *rg, size_t total) {
         return 0;
     else {
         if (rg->left > rg->right)
-            fprintf(stderr, "xsp: invalid range '%d,%d'\n", rg->left, rg->right);
+            fprintf(err, "xsp: invalid range '%d,%d'\n", rg->left, rg->right);
         else
-            fprintf(stderr, "xsp: range exceeded for total %zu matches\n", total);
+            fprintf(err, "xsp: range exceeded for total %zu matches\n", total);
         return 1;
     }
 }
 
 typedef struct {
-    unsigned char *base_ptr;
+    unsigned char *base_ptr;   // NULL in window mode, the worker maps its own window
+    int fd;                    // file to map in window mode
     size_t base_offset;        // absolute offset in file
     size_t chunk_size;         // assigned non-overlapped chunk length
     size_t file_size;          // total file size
-    struct data pattern;       // pattern to search
-    bool is_last;              // is last segment
+    size_t prefetch_offset;    // window to read ahead in window mode
+    size_t prefetch_len;
+    const anchored_memchr_idx_t *idx; // compiled pattern, shared read-only
+    uint64_t *hashes;          // block hashes of the chunk for --cache, NULL when not hashing
     offset_t *results;         // absolute offsets found (allocated)
     int result_count;          // number of results
+    int error;                 // errno of a failed window mapping
+    pool_job_t job;
 } search_task_t;
 
-static void *search_worker(void *arg) {
+/*
+the daemon keeps files mapped across requests, one truncated in place
+would raise SIGBUS in the middle of a scan, with catch_map_faults the
+task fails instead and every other client is unaffected
+*/
+static _Thread_local sigjmp_buf *fault_jump = NULL;
+
+static void on_map_fault(int sig) {
+    if (fault_jump != NULL)
+        siglongjmp(*fault_jump, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void catch_map_faults() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_map_fault;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/* matches in the chunk at `base`, relative to it, hashing its blocks for --cache on the way */
+static offset_t *match_chunk(search_task_t *task, unsigned char *base, size_t effective_len, int *count) {
+    const size_t pattern_length = task->idx->maxlen;
+    int local_count = 0;
+    offset_t *local = NULL;
+    if (task->hashes == NULL) {
+        local = anchored_memchr_match(task->idx,
+                                      base,
+                                      base + effective_len,
+                                      &local_count);
+    }
+    else {
+        // match and hash one HASH_BLOCK at a time so the block is hashed while it is still in cache,
+        // chunks start on a HASH_BLOCK boundary
+        size_t cap = 0;
+        for (size_t off = 0; off < task->chunk_size; off += HASH_BLOCK) {
+            size_t len = task->chunk_size - off < HASH_BLOCK ? task->chunk_size - off : HASH_BLOCK;
+            size_t scan = effective_len - off < len + pattern_length - 1 ? effective_len - off
+                                                                          : len + pattern_length - 1;
+            int found = 0;
+            offset_t *block = anchored_memchr_match(task->idx, base + off, base + off + scan, &found);
+            task->hashes[off / HASH_BLOCK] = block_hash(base + off, len);
+            if ((size_t)(local_count + found) > cap) {
+                cap = (size_t)(local_count + found) * 2;
+                local = realloc(local, cap * sizeof(offset_t));
+            }
+            // matches starting in the overlap belong to the next block
+            for (int i = 0; i < found; i++) {
+                if (offset_of(block[i]) < (offset_t)len)
+                    local[local_count++] = (offset_t)off + block[i];
+            }
+            free(block);
+        }
+    }
+    *count = local_count;
+    return local;
+}
+
+/* false when the mapping faulted under the match, its partial results are leaked */
+static bool guarded_match(search_task_t *task, unsigned char *base, size_t effective_len, offset_t **local,
+                          int *count) {
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1) != 0) {
+        fault_jump = NULL;
+        return false;
+    }
+    fault_jump = &jump;
+    *local = match_chunk(task, base, effective_len, count);
+    fault_jump = NULL;
+    return true;
+}
+
+static void search_worker(void *arg) {
     search_task_t *task = (search_task_t *)arg;
     task->results = NULL;
     task->result_count = 0;
+    task->error = 0;
 
-    const size_t pattern_length = task->pattern.len;
-    if (pattern_length == 0) return NULL;
+    const size_t pattern_length = task->idx->maxlen;
+    if (pattern_length == 0) return;
 
     // determine effective scan length including overlap but not beyond file end
     size_t max_span = task->chunk_size + (pattern_length > 0 ? (pattern_length - 1) : 0);
     size_t available = task->file_size - task->base_offset;
     size_t effective_len = max_span < available ? max_span : available;
 
-    anchored_memchr_idx_t skipidx;
-    anchored_memchr_init(&skipidx, task->pattern.len, task->pattern.buf);
+    unsigned char *base_ptr = task->base_ptr;
+    unsigned char *window = NULL;
+    size_t window_offset = 0, window_len = 0;
+    if (base_ptr == NULL) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        window_offset = task->base_offset / page * page;
+        window_len = task->base_offset - window_offset + effective_len;
+        window = mmap(NULL, window_len, PROT_READ, MAP_SHARED, task->fd, (off_t)window_offset);
+        if (window == MAP_FAILED) {
+            task->error = errno;
+            return;
+        }
+        madvise(window, window_len, MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_WILLNEED
+        if (task->prefetch_len > 0)
+            posix_fadvise(task->fd, (off_t)task->prefetch_offset, (off_t)task->prefetch_len,
+                          POSIX_FADV_WILLNEED);
+#endif
+        base_ptr = window + (task->base_offset - window_offset);
+    }
 
     int local_count = 0;
-    offset_t *local = anchored_memchr_match(&skipidx,
-                                 task->base_ptr,
-                                 task->base_ptr + effective_len,
-                                 &local_count);
+    offset_t *local = NULL;
+    if (!guarded_match(task, base_ptr, effective_len, &local, &local_count)) {
+        if (window != NULL)
+            munmap(window, window_len);
+        task->error = EIO;
+        return;
+    }
+
+    // give the scanned pages back so the footprint stays at one window per worker
+    if (window != NULL) {
+        madvise(window, window_len, MADV_DONTNEED);
+        munmap(window, window_len);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(task->fd, (off_t)window_offset, (off_t)window_len, POSIX_FADV_DONTNEED);
+#endif
+    }
 
     // filter to avoid duplicates across segment boundaries and convert to absolute
     size_t cutoff = task->base_offset + task->chunk_size;
-    bool apply_cutoff = !task->is_last; // last segment keeps all
     int kept = 0;
     for (int i = 0; i < local_count; i++) {
         offset_t abs_off = (offset_t)task->base_offset + local[i];
-        if (!apply_cutoff || abs_off < (offset_t)cutoff) {
+        if (offset_of(abs_off) < (offset_t)cutoff) {
             local[kept++] = abs_off;
         }
     }
     task->results = local;
     task->result_count = kept;
-    anchored_memchr_release(&skipidx);
-    return NULL;
 }
 
 static int get_online_cpu_count() {
@@ -100,105 +228,271 @@ static int get_online_cpu_count() {
     return (int)n;
 }
 
-offset_t *hex_search(FILE *fp, struct data hex, size_t *count) {
-    *count = 0;
-    if (hex.len == 0) {
-        return (offset_t *)malloc(0);
+typedef struct {
+    size_t start, end;
+} extent_t;
+
+/*
+fraction of sampled pages of the extents that are in the page cache,
+without `map` (window mode) each sampled page of `fd` is mapped on its own
+*/
+static double resident_fraction(unsigned char *map, int fd, const extent_t *ext, size_t data_size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (data_size + page - 1) / page;
+    size_t samples = pages < RESIDENCY_SAMPLES ? pages : RESIDENCY_SAMPLES;
+    size_t resident = 0, e = 0, before = 0; // data bytes in the extents before ext[e]
+    for (size_t i = 0; i < samples; i++) {
+        size_t at = (2 * i + 1) * data_size / (2 * samples);
+        while (at >= before + ext[e].end - ext[e].start) {
+            before += ext[e].end - ext[e].start;
+            e++;
+        }
+        size_t off = (ext[e].start + at - before) / page * page;
+        mincore_vec_t vec = 0;
+        if (map != NULL) {
+            if (mincore(map + off, 1, &vec) == 0 && (vec & 1))
+                resident++;
+            continue;
+        }
+        void *probe = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, (off_t)off);
+        if (probe == MAP_FAILED)
+            continue;
+        if (mincore(probe, page, &vec) == 0 && (vec & 1))
+            resident++;
+        munmap(probe, page);
     }
+    return samples > 0 ? (double)resident / (double)samples : 1.0;
+}
 
-    // determine file size
-    long cur = ftell(fp);
-    fseek(fp, 0, SEEK_END);
-    long file_size_long = ftell(fp);
-    fseek(fp, cur, SEEK_SET);
-    if (file_size_long <= 0) {
-        return (offset_t *)malloc(0);
+/*
+with -t unset, use no more threads than the data to scan can keep busy,
+small files are scanned on the calling thread
+*/
+static int auto_thread_count(unsigned char *map, int fd, const extent_t *ext, size_t data_size) {
+    int threads = get_online_cpu_count();
+    size_t by_size = data_size / MIN_THREAD_BYTES;
+    if (by_size < (size_t)threads)
+        threads = by_size < 1 ? 1 : (int)by_size;
+    // a cold file is bound by the disk, extra threads only add contention
+    if (threads > COLD_THREADS && resident_fraction(map, fd, ext, data_size) < 0.5)
+        threads = COLD_THREADS;
+    return threads;
+}
+
+int search_threads(unsigned char *map, size_t file_size) {
+    extent_t whole = {0, file_size};
+    return num_threads > 0 ? num_threads : auto_thread_count(map, -1, &whole, file_size);
+}
+
+static pool_t *search_pool = NULL;
+static pthread_mutex_t search_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+worker threads are created once and reused by every search in this process,
+daemon connections may ask for the pool concurrently
+*/
+pool_t *get_search_pool() {
+    pthread_mutex_lock(&search_pool_lock);
+    if (search_pool == NULL) {
+        int threads = num_threads;
+        if (threads <= 0) threads = get_online_cpu_count();
+        search_pool = pool_create(threads);
     }
-    size_t file_size = (size_t)file_size_long;
-    if (file_size < hex.len) {
-        return (offset_t *)malloc(0);
+    pthread_mutex_unlock(&search_pool_lock);
+    return search_pool;
+}
+
+void search_pool_release() {
+    if (search_pool != NULL) {
+        pool_destroy(search_pool);
+        search_pool = NULL;
     }
+}
 
-    int fd = fileno(fp);
-    unsigned char *map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED) {
-        // fallback: single-threaded buffered scan
-        size_t matched = 0;
-        size_t chunk_size = max(CHUNK_SIZE, hex.len * 2);
-        anchored_memchr_idx_t skipidx;
-        anchored_memchr_init(&skipidx, hex.len, hex.buf);
+/* true when some variant could match inside a run of zeros */
+static bool matches_zeros(const anchored_memchr_idx_t *idx) {
+    for (int v = 0; v < idx->nvar; v++) {
+        const unsigned char *patt = idx->vars != NULL ? idx->vars[v].patt : idx->patt;
+        size_t len = idx->vars != NULL ? idx->vars[v].len : idx->plen;
+        size_t k = 0;
+        while (k < len && patt[k] == 0)
+            k++;
+        if (k == len)
+            return true;
+    }
+    return false;
+}
 
-        int cur_matched;
-        offset_t *offsets = NULL;
-        uint8_t *buffer = malloc(chunk_size + hex.len - 1);
-
-        rewind(fp);
-        size_t readc = fread(buffer + hex.len - 1, 1, chunk_size, fp);
-        offsets = anchored_memchr_match(&skipidx,
-            buffer + hex.len - 1,
-            buffer + hex.len - 1 + readc,
-            &cur_matched);
-        matched += cur_matched;
-        int offsize = (cur_matched & 0xffffff00) + STEP_SIZE;
-        offsets = realloc(offsets, offsize * sizeof(offset_t));
-        size_t filepos = chunk_size - (hex.len - 1);
-        while (readc == chunk_size) {
-            memmove(buffer, buffer + chunk_size, hex.len - 1);
-            readc = fread(buffer + hex.len - 1, 1, chunk_size, fp);
-            offset_t *cur_offs = anchored_memchr_match(&skipidx,
-                buffer,
-                buffer + readc + hex.len - 1,
-                &cur_matched);
-            if (matched + cur_matched > (size_t)offsize) {
-                offsize = max(matched + cur_matched, (size_t)offsize + STEP_SIZE);
-                offsets = realloc(offsets, offsize * sizeof(offset_t));
-            }
-            for (int i = 0; i < cur_matched; i++) {
-                offsets[matched++] = filepos + cur_offs[i];
+/*
+ranges of match starts worth scanning: the data extents of a sparse file,
+each widened by `pad` bytes in front for matches that begin in a hole,
+holes shorter than MIN_HOLE_SKIP are scanned through
+*/
+static size_t find_extents(int fd, size_t file_size, size_t pad, extent_t **out) {
+    size_t n = 0, cap = 16;
+    extent_t *ext = (extent_t *)malloc(cap * sizeof(extent_t));
+    *out = ext;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t saved = fd >= 0 ? lseek(fd, 0, SEEK_CUR) : -1;
+    bool supported = saved >= 0;
+    off_t pos = 0;
+    while (supported && (size_t)pos < file_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            supported = errno == ENXIO; // ENXIO: no data past pos
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (size_t)hole > file_size)
+            hole = (off_t)file_size;
+        size_t start = (size_t)data > pad ? (size_t)data - pad : 0;
+        if (n > 0 && start <= ext[n - 1].end + MIN_HOLE_SKIP) {
+            ext[n - 1].end = (size_t)hole;
+        }
+        else {
+            if (n == cap) {
+                cap *= 2;
+                ext = (extent_t *)realloc(ext, cap * sizeof(extent_t));
+                *out = ext;
             }
-            free(cur_offs);
-            filepos += chunk_size;
+            ext[n++] = (extent_t){start, (size_t)hole};
         }
-        *count = matched;
-        free(buffer);
-        anchored_memchr_release(&skipidx);
-        return offsets;
+        pos = hole;
+    }
+    if (saved >= 0)
+        lseek(fd, saved, SEEK_SET);
+    if (supported)
+        return n; // 0 when the file is all hole
+#else
+    (void)fd;
+    (void)pad;
+#endif
+    ext[0] = (extent_t){0, file_size};
+    return 1;
+}
+
+/*
+holes are not read, so their blocks get the hash of zeros and extents are
+widened to whole blocks for every block to be either read or a hole
+*/
+static void align_extents(extent_t *ext, size_t next, size_t file_size, content_hash_t *ch) {
+    unsigned char *zeros = calloc(HASH_BLOCK, 1);
+    uint64_t zero_hash = block_hash(zeros, HASH_BLOCK);
+    for (size_t b = 0; b < ch->nblocks; b++)
+        ch->blocks[b] = zero_hash;
+    if (file_size % HASH_BLOCK != 0)
+        ch->blocks[ch->nblocks - 1] = block_hash(zeros, file_size % HASH_BLOCK);
+    free(zeros);
+
+    for (size_t e = 0; e < next; e++) {
+        ext[e].start = ext[e].start / HASH_BLOCK * HASH_BLOCK;
+        ext[e].end = (ext[e].end + HASH_BLOCK - 1) / HASH_BLOCK * HASH_BLOCK;
+        if (ext[e].end > file_size)
+            ext[e].end = file_size;
+        if (e > 0 && ext[e].start < ext[e - 1].end)
+            ext[e].start = ext[e - 1].end;
     }
+}
 
-    int threads = num_threads;
-    if (threads <= 0) threads = get_online_cpu_count();
-    if (threads < 1) threads = 1;
-    if ((size_t)threads > file_size) threads = (int)file_size; // avoid zero chunk
+/*
+scan `map`, or when it is NULL, map `fd` in windows of at most `window` bytes
+with `ch`, every block of the file is hashed by the same pass
+*/
+static offset_t *search_run(const anchored_memchr_idx_t *idx, unsigned char *map, int fd, size_t window,
+                            size_t file_size, size_t *count, patch_stream_t *ps, content_hash_t *ch) {
+    *count = 0;
+    if (idx->plen == 0 || file_size < idx->plen) {
+        return (offset_t *)malloc(0);
+    }
 
-    size_t base_chunk = file_size / (size_t)threads;
+    // holes of a sparse file can only match a pattern of zeros
+    extent_t *ext;
+    size_t next;
+    if (matches_zeros(idx)) {
+        ext = (extent_t *)malloc(sizeof(extent_t));
+        ext[0] = (extent_t){0, file_size};
+        next = 1;
+    }
+    else {
+        next = find_extents(fd, file_size, idx->maxlen - 1, &ext);
+    }
+    if (ch != NULL)
+        align_extents(ext, next, file_size, ch);
+    size_t data_size = 0;
+    for (size_t e = 0; e < next; e++)
+        data_size += ext[e].end - ext[e].start;
+    if (data_size == 0) {
+        free(ext);
+        if (ch != NULL)
+            ch->valid = true;
+        return (offset_t *)malloc(0);
+    }
+
+    int threads = num_threads > 0 ? num_threads : auto_thread_count(map, fd, ext, data_size);
+    if ((size_t)threads > data_size) threads = (int)data_size; // avoid zero chunk
+    pool_t *pool = threads > 1 ? get_search_pool() : NULL;
+    if (pool == NULL)
+        threads = 1;
+    else if (threads > pool_size(pool))
+        threads = pool_size(pool);
+
+    // split finer than the thread count so results can be consumed while scanning
+    int ntasks = threads;
+    if (data_size / ((size_t)threads * TASKS_PER_THREAD) >= MIN_TASK_SIZE)
+        ntasks = threads * TASKS_PER_THREAD;
+
+    size_t base_chunk = (data_size + (size_t)ntasks - 1) / (size_t)ntasks;
     if (base_chunk == 0) base_chunk = 1;
+    if (map == NULL && base_chunk > window)
+        base_chunk = max(window, idx->plen);
+    if (ch != NULL)
+        base_chunk = (base_chunk + HASH_BLOCK - 1) / HASH_BLOCK * HASH_BLOCK;
+
+    ntasks = 0;
+    for (size_t e = 0; e < next; e++)
+        ntasks += (int)((ext[e].end - ext[e].start + base_chunk - 1) / base_chunk);
+    search_task_t *tasks = (search_task_t *)malloc((size_t)ntasks * sizeof(search_task_t));
 
-    pthread_t *tids = (pthread_t *)malloc((size_t)threads * sizeof(pthread_t));
-    search_task_t *tasks = (search_task_t *)malloc((size_t)threads * sizeof(search_task_t));
-
-    for (int i = 0; i < threads; i++) {
-        size_t base_offset = (size_t)i * base_chunk;
-        size_t remaining = file_size - base_offset;
-        size_t chunk_len = (i == threads - 1) ? remaining : base_chunk;
-        tasks[i] = (search_task_t){
-            .base_ptr = map + base_offset,
-            .base_offset = base_offset,
-            .chunk_size = chunk_len,
-            .file_size = file_size,
-            .pattern = hex,
-            .is_last = (i == threads - 1),
-            .results = NULL,
-            .result_count = 0,
-        };
-        pthread_create(&tids[i], NULL, search_worker, &tasks[i]);
-    }
-
-    // merge results
+    int i = 0;
+    for (size_t e = 0; e < next; e++) {
+        for (size_t base_offset = ext[e].start; base_offset < ext[e].end; base_offset += base_chunk, i++) {
+            size_t remaining = ext[e].end - base_offset;
+            tasks[i] = (search_task_t){
+                .base_ptr = map != NULL ? map + base_offset : NULL,
+                .fd = fd,
+                .base_offset = base_offset,
+                .chunk_size = remaining < base_chunk ? remaining : base_chunk,
+                .file_size = file_size,
+                .idx = idx,
+                .hashes = ch != NULL ? ch->blocks + base_offset / HASH_BLOCK : NULL,
+                .results = NULL,
+                .result_count = 0,
+            };
+        }
+    }
+    free(ext);
+    // each worker reads ahead the window it is likely to take next
+    for (int i = 0; map == NULL && i + threads < ntasks; i++) {
+        tasks[i].prefetch_offset = tasks[i + threads].base_offset;
+        tasks[i].prefetch_len = tasks[i + threads].chunk_size;
+    }
+    for (int i = 0; pool != NULL && i < ntasks; i++)
+        pool_submit(pool, &tasks[i].job, search_worker, &tasks[i]);
+
+    // merge results in file order
     size_t matched_total = 0;
     size_t offcap = STEP_SIZE;
     offset_t *all_offs = (offset_t *)malloc(offcap * sizeof(offset_t));
-    for (int i = 0; i < threads; i++) {
-        pthread_join(tids[i], NULL);
+    int error = 0;
+    for (i = 0; i < ntasks; i++) {
+        if (pool != NULL)
+            pool_wait(pool, &tasks[i].job);
+        else
+            search_worker(&tasks[i]);
+        if (tasks[i].error != 0) {
+            error = tasks[i].error;
+            ps = NULL; // nothing past the failed window is final
+        }
         int cnt = tasks[i].result_count;
         if (matched_total + (size_t)cnt > offcap) {
             size_t needed = matched_total + (size_t)cnt;
@@ -208,44 +502,300 @@ offset_t *hex_search(FILE *fp, struct data hex, size_t *count) {
         if (cnt > 0 && tasks[i].results != NULL) {
             memcpy(all_offs + matched_total, tasks[i].results, (size_t)cnt * sizeof(offset_t));
             matched_total += (size_t)cnt;
-            free(tasks[i].results);
+        }
+        free(tasks[i].results);
+
+        // a match may be written once no pending task will read its bytes
+        if (ps != NULL) {
+            size_t safe = matched_total;
+            if (i + 1 < ntasks) {
+                offset_t limit = (offset_t)tasks[i + 1].base_offset;
+                while (safe > 0 && offset_of(all_offs[safe - 1]) + idx->maxlen > limit)
+                    safe--;
+            }
+            patch_stream_feed(ps, all_offs, safe, false);
         }
     }
 
-    free(tids);
     free(tasks);
-    munmap(map, file_size);
 
+    if (error != 0) {
+        fprintf(stderr, "xsp: mmap: %s\n", strerror(error));
+        free(all_offs);
+        return NULL;
+    }
+
+    if (ch != NULL)
+        ch->valid = true;
     *count = matched_total;
     return all_offs;
 }
 
-int hex_patch(FILE *fp, struct data hex, offset_t *offsets, struct range rg) {
-    int patched = 0;
+offset_t *hex_search_map(const anchored_memchr_idx_t *idx, unsigned char *map, size_t file_size, size_t *count,
+                         patch_stream_t *ps) {
+    return search_run(idx, map, -1, 0, file_size, count, ps, NULL);
+}
+
+static size_t get_physical_memory() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page <= 0) return SIZE_MAX;
+    return (size_t)pages * (size_t)page;
+}
+
+static bool can_mmap(int fd) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *probe = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (probe == MAP_FAILED)
+        return false;
+    munmap(probe, page);
+    return true;
+}
+
+/*
+fallback for files that cannot be mapped: single-threaded buffered scan
+like search_worker, each pass reads maxlen - 1 bytes past its chunk and keeps
+only matches starting inside the chunk, the rest are found by the next pass
+*/
+static offset_t *search_buffered(FILE *fp, const anchored_memchr_idx_t *idx, size_t *count) {
+    const size_t overlap = idx->maxlen - 1;
+    size_t chunk_size = max(CHUNK_SIZE, idx->maxlen * 2);
+    size_t matched = 0, offsize = STEP_SIZE;
+    offset_t *offsets = malloc(offsize * sizeof(offset_t));
+    uint8_t *buffer = malloc(chunk_size + overlap);
+
+    rewind(fp);
+    size_t filled = fread(buffer, 1, chunk_size + overlap, fp);
+    offset_t filepos = 0;
+    for (;;) {
+        bool last = filled < chunk_size + overlap;
+        int cur_matched;
+        offset_t *cur_offs = anchored_memchr_match(idx, buffer, buffer + filled, &cur_matched);
+        if (matched + cur_matched > offsize) {
+            offsize = max(matched + cur_matched, offsize + STEP_SIZE);
+            offsets = realloc(offsets, offsize * sizeof(offset_t));
+        }
+        for (int i = 0; i < cur_matched; i++) {
+            if (last || offset_of(cur_offs[i]) < chunk_size)
+                offsets[matched++] = filepos + cur_offs[i];
+        }
+        free(cur_offs);
+        if (last)
+            break;
+        memmove(buffer, buffer + chunk_size, overlap);
+        filled = overlap + fread(buffer + overlap, 1, chunk_size, fp);
+        filepos += chunk_size;
+    }
+    *count = matched;
+    free(buffer);
+    return offsets;
+}
+
+offset_t *hex_search(FILE *fp, const anchored_memchr_idx_t *idx, size_t *count, patch_stream_t *ps,
+                     content_hash_t *ch) {
+    *count = 0;
+    if (idx->plen == 0) {
+        return (offset_t *)malloc(0);
+    }
+
+    // determine file size
+    long cur = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long file_size_long = ftell(fp);
+    fseek(fp, cur, SEEK_SET);
+    if (file_size_long <= 0) {
+        return (offset_t *)malloc(0);
+    }
+    size_t file_size = (size_t)file_size_long;
+    if (file_size < idx->plen) {
+        return (offset_t *)malloc(0);
+    }
+
+    int fd = fileno(fp);
+    if (ch != NULL) {
+        ch->size = file_size;
+        ch->nblocks = (file_size + HASH_BLOCK - 1) / HASH_BLOCK;
+        ch->blocks = (uint64_t *)malloc(ch->nblocks * sizeof(uint64_t));
+        ch->valid = false;
+    }
+
+    // files that do not fit comfortably in memory are scanned in windows
+    size_t window = window_size;
+    if (window == 0 && file_size > get_physical_memory() / 2)
+        window = DEFAULT_WINDOW;
+    unsigned char *map = MAP_FAILED;
+    if (window == 0) {
+        map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            window = DEFAULT_WINDOW; // address space too small for one mapping
+    }
+
+    offset_t *all_offs;
+    if (map != MAP_FAILED) {
+        all_offs = search_run(idx, map, fd, 0, file_size, count, ps, ch);
+        munmap(map, file_size);
+    }
+    else if (can_mmap(fd)) {
+        all_offs = search_run(idx, NULL, fd, window, file_size, count, ps, ch);
+    }
+    else {
+        all_offs = search_buffered(fp, idx, count);
+    }
+    return all_offs;
+}
+
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, offset_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)off);
+        if (n <= 0)
+            return 1;
+        buf += n;
+        len -= (size_t)n;
+        off += (offset_t)n;
+    }
+    return 0;
+}
+
+/*
+adjacent and overlapping matches are coalesced into one write,
+each match is replaced with the entry of `hex` for its variant
+*/
+int hex_patch(FILE *fp, const struct data *hex, int nhex, offset_t *offsets, struct range rg) {
+    int fd = fileno(fp);
+    int patched = 0, pending = 0;
+    size_t longest = 0;
+    for (int v = 0; v < nhex; v++)
+        longest = max(longest, hex[v].len);
+    size_t batch_cap = PATCH_BATCH + longest;
+    uint8_t *batch = malloc(batch_cap);
+    offset_t batch_off = 0;
+    size_t batch_len = 0;
+
+    fflush(fp);
     for (int i = rg.left; i <= rg.right; i++) {
-        if (fseek(fp, offsets[i], SEEK_SET) != 0) {
-            perror("fseek");
-            goto exit;
+        offset_t off = offset_of(offsets[i]);
+        const struct data *rep = &hex[variant_of(offsets[i])];
+        if (batch_len > 0 && (off > batch_off + batch_len ||
+                              off - batch_off + rep->len > batch_cap)) {
+            if (pwrite_all(fd, batch, batch_len, batch_off) != 0) {
+                perror("pwrite");
+                goto exit;
+            }
+            patched += pending;
+            pending = 0;
+            batch_len = 0;
         }
-        if (fwrite(hex.buf, hex.len, 1, fp) != 1) {
-            perror("fwrite");
+        if (batch_len == 0)
+            batch_off = off;
+        memcpy(batch + (off - batch_off), rep->buf, rep->len);
+        batch_len = max(batch_len, (size_t)(off - batch_off) + rep->len);
+        pending++;
+    }
+    if (batch_len > 0) {
+        if (pwrite_all(fd, batch, batch_len, batch_off) != 0) {
+            perror("pwrite");
             goto exit;
         }
-        patched++;
+        patched += pending;
     }
 exit:
+    free(batch);
     return patched;
 }
 
-int show_offsets(offset_t *offsets, struct range rg) {
+void patch_stream_init(patch_stream_t *ps, FILE *fp, const struct data *hex, int nhex, struct range rg,
+                       FILE *err) {
+    *ps = (patch_stream_t){
+        .fp = fp,
+        .hex = hex,
+        .nhex = nhex,
+        .rg = rg,
+        .err = err,
+    };
+}
+
+/*
+patch every match that is known to be inside the range
+until `final`, only indexes that stay valid for any larger total are written,
+so an invalid range is still rejected before anything is patched
+*/
+void patch_stream_feed(patch_stream_t *ps, offset_t *offsets, size_t count, bool final) {
+    if (ps->finished)
+        return;
+    struct range rg = ps->rg;
+    if (final) {
+        ps->finished = true;
+        if (count == 0 || update_range(&rg, count, ps->err) != 0) {
+            ps->failed = true;
+            return;
+        }
+        ps->expected = rg.right - rg.left + 1;
+    }
+    else {
+        if (rg.left < 0)
+            return; // depends on the total
+        long long last = rg.right >= 0 ? rg.right : (long long)count + rg.right;
+        if (last >= (long long)count || last < rg.left)
+            return;
+        rg.right = (int)last;
+    }
+
+    if (ps->failed)
+        return;
+    if (rg.left < ps->next)
+        rg.left = ps->next;
+    if (rg.left > rg.right)
+        return;
+    int done = hex_patch(ps->fp, ps->hex, ps->nhex, offsets, rg);
+    ps->patched += done;
+    ps->next = rg.right + 1;
+    if (done != rg.right - rg.left + 1)
+        ps->failed = true;
+}
+
+int show_offsets(FILE *out, offset_t *offsets, struct range rg) {
     int shown = 0;
     for (int i = rg.left; i <= rg.right; i++) {
-        printf("0x%llx\n", offsets[i]);
+        if (num_variants > 1)
+            fprintf(out, "0x%llx (%s)\n", offset_of(offsets[i]), variants[variant_of(offsets[i])].name);
+        else
+            fprintf(out, "0x%llx\n", offset_of(offsets[i]));
         shown++;
     }
     return shown;
 }
 
+int finish_request(FILE *fp, const struct data *hex, int nhex, offset_t *offsets, size_t count,
+                   struct range rg, patch_stream_t *ps, FILE *out, FILE *err) {
+    patch_stream_t local;
+    if (hex != NULL && ps == NULL) {
+        patch_stream_init(&local, fp, hex, nhex, rg, err);
+        ps = &local;
+    }
+
+    if (count == 0) {
+        fprintf(out, "no matches found!\n");
+        return 1;
+    }
+
+    if (hex != NULL) { // patch
+        patch_stream_feed(ps, offsets, count, true);
+        if (ps->expected == 0)
+            return 1; // invalid range
+        fprintf(out, "%d(%d) matches patched\n", ps->patched, ps->expected);
+        return ps->patched != ps->expected;
+    }
+
+    if (update_range(&rg, count, err) != 0) {
+        return 1;
+    }
+
+    int expected = rg.right - rg.left + 1;
+    int proceeded = show_offsets(out, offsets, rg);
+    fprintf(out, "%d(%d) matches found\n", proceeded, expected);
+    return proceeded != expected;
+}
+
 double get_time_ms() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -396,12 +946,14 @@ void run_benchmark(FILE *fp) {
                 continue;
             }
 
-            struct data hex = {pattern_size, pattern};
             size_t count = 0;
 
             // measure search time
             double start_time = get_time_ms();
-            offset_t *offsets = hex_search(fp, hex, &count);
+            anchored_memchr_idx_t idx;
+            anchored_memchr_init(&idx, pattern_size, pattern);
+            offset_t *offsets = hex_search(fp, &idx, &count, NULL, NULL);
+            anchored_memchr_release(&idx);
             double end_time = get_time_ms();
             double elapsed_ms = end_time - start_time;
 
@@ -451,6 +1003,18 @@ int main(const int argc, char **argv) {
         return 0;
     }
 
+    if (unique_mode) {
+        fp = fopen(file_path, "rb");
+        if (fp == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        error = find_unique(fp, unique_at);
+        fclose(fp);
+        search_pool_release();
+        return error;
+    }
+
     // handle benchmark mode
     if (benchmark_mode) {
         if (file_path == NULL) {
@@ -464,52 +1028,118 @@ int main(const int argc, char **argv) {
         }
         run_benchmark(fp);
         fclose(fp);
+        search_pool_release();
         return 0;
     }
 
+    if (serve_path != NULL) {
+        error = serve_main(serve_path);
+        search_pool_release();
+        return error;
+    }
+
     // determine mode
     if (hex2.buf == NULL)
         mode = SEARCH_MODE;
     else
         mode = PATCH_MODE;
 
-    if (mode == SEARCH_MODE)
-        fp = fopen(file_path, "rb");
-    else
-        fp = fopen(file_path, "rb+");
-    if (fp == NULL) {
+    // an empty pattern matches nothing, every variant of it is empty too
+    if (hex1.len == 0) {
+        puts("no matches found!");
         error = 1;
-        perror("fopen");
         goto exit;
     }
 
-    offs = hex_search(fp, hex1, &count);
+    if (connect_path != NULL) {
+        if (num_variants > 0) {
+            fprintf(stderr, "xsp: --icase and --encoding are not supported with --connect\n");
+            error = 1;
+            goto exit;
+        }
+        error = client_main(connect_path);
+        goto exit;
+    }
 
-    if (count == 0) {
+    // a process is patched through its mem file, at the virtual addresses found
+    char mem_path[64];
+    if (target_pid > 0)
+        snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", target_pid);
+    if (target_pid > 0 && mode == SEARCH_MODE)
+        fp = NULL;
+    else if (mode == SEARCH_MODE)
+        fp = fopen(file_path, "rb");
+    else
+        fp = fopen(target_pid > 0 ? mem_path : file_path, "rb+");
+    if (fp == NULL && (target_pid == 0 || mode == PATCH_MODE)) {
         error = 1;
-        printf("no matches found!\n");
+        perror("fopen");
         goto exit;
     }
 
-    if (update_range(&pat_range, count) != 0) {
+    // with --icase or --encoding every variant is searched in the same pass
+    anchored_memchr_idx_t idx;
+    struct data replace[MAX_ENCODINGS] = {hex2};
+    int nreplace = 1;
+    if (num_variants > 0) {
+        anchored_memchr_var_t vars[MAX_ENCODINGS];
+        for (int i = 0; i < num_variants; i++) {
+            vars[i] = (anchored_memchr_var_t){variants[i].find.len, variants[i].find.buf, variants[i].fold.buf};
+            replace[i] = variants[i].replace;
+        }
+        nreplace = num_variants;
+        anchored_memchr_init_set(&idx, num_variants, vars);
+    }
+    else {
+        anchored_memchr_init(&idx, hex1.len, hex1.buf);
+    }
+
+    // patches are written while later chunks are still being searched
+    patch_stream_t ps;
+    if (mode == PATCH_MODE)
+        patch_stream_init(&ps, fp, replace, nreplace, pat_range, stderr);
+    int format = decompress_mode == DECOMPRESS_AUTO ? compression_format(fp) : decompress_mode;
+    if (format != DECOMPRESS_NONE && mode == PATCH_MODE) {
+        fprintf(stderr, "xsp: can't patch compressed input\n");
         error = 1;
+        anchored_memchr_release(&idx);
         goto exit;
     }
-
-    int expected = pat_range.right - pat_range.left + 1;
-    int proceeded;
-    if (mode == SEARCH_MODE) {
-        proceeded = show_offsets(offs, pat_range);
-        if (proceeded != expected)
+    if (target_pid > 0 || format != DECOMPRESS_NONE) {
+        if (target_pid > 0)
+            offs = process_search(target_pid, &idx, &count);
+        else
+            offs = decompress_search(fp, format, &idx, &count);
+        if (offs == NULL) {
             error = 1;
-        printf("%d(%d) matches found\n", proceeded, expected);
+            anchored_memchr_release(&idx);
+            goto exit;
+        }
     }
-    else { // (mode == PATCH_MODE)
-        proceeded = hex_patch(fp, hex2, offs, pat_range);
-        if (proceeded != expected)
+    else {
+        // an unchanged file, or a copy of one, is answered from the cache
+        file_stamp_t stamp;
+        content_hash_t ch = {0};
+        if (cache_dir != NULL)
+            offs = cache_lookup(fp, &idx, &stamp, &count);
+        if (offs == NULL) {
+            offs = hex_search(fp, &idx, &count, mode == PATCH_MODE ? &ps : NULL, cache_dir != NULL ? &ch : NULL);
+            if (cache_dir != NULL && offs != NULL)
+                cache_store(fp, &idx, &stamp, &ch, offs, count);
+        }
+        free(ch.blocks);
+        if (offs == NULL) {
+            // matches written before a window failed to map stay patched
+            if (mode == PATCH_MODE && ps.patched > 0)
+                printf("%d matches patched before the error\n", ps.patched);
             error = 1;
-        printf("%d(%d) matches patched\n", proceeded, expected);
+            anchored_memchr_release(&idx);
+            goto exit;
+        }
     }
+    error = finish_request(fp, mode == PATCH_MODE ? replace : NULL, nreplace, offs, count, pat_range,
+                           mode == PATCH_MODE ? &ps : NULL, stdout, stderr);
+    anchored_memchr_release(&idx);
 
 exit:
     free(offs);
@@ -517,6 +1147,13 @@ exit:
     if (mode == PATCH_MODE) {
         free(hex2.buf);
     }
-    fclose(fp);
+    for (int i = 0; i < num_variants; i++) {
+        free(variants[i].find.buf);
+        free(variants[i].fold.buf);
+        free(variants[i].replace.buf);
+    }
+    if (fp != NULL)
+        fclose(fp);
+    search_pool_release();
     return error;
 }
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+--cache: a first scan, a copy answered without a scan, and edits in place
+with and without a new mtime, every answer checked against a brute-force scan
+usage: cache_test <xsp> <scratch dir>
+*/
+
+#define FILE_SIZE   (1024 * 1024 + 12345)
+#define PATTERN_LEN 8
+
+static unsigned long long rng_state = 0xd1b54a32d192ed03ULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int failures = 0;
+
+static int write_file(const char *path, const unsigned char *buf, long mtime) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(path);
+        return 1;
+    }
+    fclose(fp);
+    struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+    return utimensat(AT_FDCWD, path, times, 0);
+}
+
+/* what xsp should print, one hex offset per match then the total */
+static void expected_output(const unsigned char *buf, const unsigned char *pat, char *out) {
+    size_t n = 0;
+    for (size_t i = 0; i + PATTERN_LEN <= FILE_SIZE; i++) {
+        if (memcmp(buf + i, pat, PATTERN_LEN) == 0) {
+            out += sprintf(out, "0x%zx\n", i);
+            n++;
+        }
+    }
+    sprintf(out, "%zu(%zu) matches found\n", n, n);
+}
+
+static void check(const char *what, const char *xsp, const char *dir, const char *file, const char *hex,
+                  const unsigned char *buf, const unsigned char *pat) {
+    char cmd[4096], got[4096], expected[4096];
+    snprintf(cmd, sizeof(cmd), "%s -t 2 --cache %s/cache -f %s/%s %s", xsp, dir, dir, file, hex);
+    FILE *p = popen(cmd, "r");
+    size_t n = p != NULL ? fread(got, 1, sizeof(got) - 1, p) : 0;
+    got[n] = '\0';
+    if (p != NULL)
+        pclose(p);
+    expected_output(buf, pat, expected);
+    if (strcmp(got, expected) != 0) {
+        fprintf(stderr, "%s: %s\n%sexpected:\n%s", what, cmd, got, expected);
+        failures++;
+    }
+}
+
+/* inode of the only results entry, a scan replaces it and a hit leaves it alone */
+static ino_t results_entry(const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/cache", dir);
+    DIR *d = opendir(path);
+    ino_t ino = 0;
+    int n = 0;
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.' || strncmp(e->d_name, "stat-", 5) == 0 || strncmp(e->d_name, "size-", 5) == 0)
+            continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/cache/%s", dir, e->d_name);
+        if (stat(path, &st) == 0)
+            ino = st.st_ino;
+        n++;
+    }
+    if (d != NULL)
+        closedir(d);
+    return n == 1 ? ino : 0;
+}
+
+static void plant(unsigned char *buf, const unsigned char *pat, size_t at) {
+    memcpy(buf + at, pat, PATTERN_LEN);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: cache_test <xsp> <scratch dir>\n");
+        return 1;
+    }
+    const char *xsp = argv[1], *dir = argv[2];
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s' && mkdir -p '%s'", dir, dir);
+    if (system(cmd) != 0)
+        return 1;
+
+    unsigned char *buf = malloc(FILE_SIZE), pat[PATTERN_LEN];
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        buf[i] = (unsigned char)rnd();
+    char hex[2 * PATTERN_LEN + 1];
+    for (int k = 0; k < PATTERN_LEN; k++) {
+        pat[k] = (unsigned char)rnd();
+        sprintf(hex + 2 * k, "%02x", pat[k]);
+    }
+    // one across a HASH_BLOCK edge, one in the last partial block
+    plant(buf, pat, 0);
+    plant(buf, pat, 64 * 1024 - 3);
+    plant(buf, pat, FILE_SIZE / 2);
+    plant(buf, pat, FILE_SIZE - PATTERN_LEN);
+
+    unsigned char *copy = malloc(FILE_SIZE);
+    memcpy(copy, buf, FILE_SIZE);
+    char a[4096], b[4096];
+    snprintf(a, sizeof(a), "%s/a.bin", dir);
+    snprintf(b, sizeof(b), "%s/b.bin", dir);
+    long old = (long)time(NULL) - 100000;
+    if (write_file(a, buf, old) != 0 || write_file(b, buf, old) != 0)
+        return 1;
+    // stamps are only kept for files that have not changed in the last second
+    sleep(2);
+
+    check("first scan", xsp, dir, "a.bin", hex, buf, pat);
+    ino_t entry = results_entry(dir);
+    if (entry == 0) {
+        fprintf(stderr, "first scan: no results entry in the cache\n");
+        failures++;
+    }
+    check("copy", xsp, dir, "b.bin", hex, buf, pat);
+    if (results_entry(dir) != entry) {
+        fprintf(stderr, "copy: scanned again instead of a cache hit\n");
+        failures++;
+    }
+    check("unchanged", xsp, dir, "a.bin", hex, buf, pat);
+    if (results_entry(dir) != entry) {
+        fprintf(stderr, "unchanged: scanned again instead of a cache hit\n");
+        failures++;
+    }
+
+    // same size, new content and a new mtime
+    buf[FILE_SIZE / 2] ^= 0xff;
+    plant(buf, pat, 300000);
+    if (write_file(a, buf, old + 10) != 0)
+        return 1;
+    check("modified", xsp, dir, "a.bin", hex, buf, pat);
+
+    // same size and the mtime of the content just cached
+    buf[0] ^= 0xff;
+    plant(buf, pat, 700001);
+    if (write_file(a, buf, old + 10) != 0)
+        return 1;
+    check("modified, same mtime", xsp, dir, "a.bin", hex, buf, pat);
+    check("copy after the edits", xsp, dir, "b.bin", hex, copy, pat);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd) != 0)
+        failures++;
+    free(copy);
+    free(buf);
+    return failures != 0;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+--decompress on gzip, multi-member gzip and BGZF input, offsets checked
+against bf on the raw decompressed file
+usage: decompress_test <xsp> <bf> <scratch prefix>
+*/
+
+#define RAW_SIZE    (10 * 1024 * 1024 + 4321)
+#define DECOMP_BLOCK (4 * 1024 * 1024)     // blocks of the streaming path in src/decompress.c
+#define MEMBER_SIZE (1024 * 1024 + 99)     // uneven members of the multi-member file
+#define BGZF_BLOCK  (60 * 1024)            // input per BGZF block, which holds at most 64K
+
+static unsigned long long rng_state = 0xbf58476d1ce4e5b9ULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int failures = 0;
+
+/* one gzip member of `len` bytes at the end of `out` */
+static size_t gzip_member(unsigned char *out, const unsigned char *in, size_t len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)deflateBound(&zs, (uLong)len);
+    deflate(&zs, Z_FINISH);
+    size_t n = zs.total_out;
+    deflateEnd(&zs);
+    return n;
+}
+
+/* a BGZF block: a raw deflate stream behind a gzip header whose BC field records the block size */
+static size_t bgzf_block(unsigned char *out, const unsigned char *in, size_t len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out + 18;
+    zs.avail_out = 0x10000 - 26;
+    deflate(&zs, Z_FINISH);
+    size_t size = 18 + zs.total_out + 8;
+    deflateEnd(&zs);
+    static const unsigned char head[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0};
+    memcpy(out, head, sizeof(head));
+    out[16] = (unsigned char)((size - 1) & 0xff);
+    out[17] = (unsigned char)((size - 1) >> 8);
+    uLong crc = crc32(crc32(0, NULL, 0), in, (uInt)len);
+    for (int k = 0; k < 4; k++) {
+        out[size - 8 + k] = (unsigned char)(crc >> (8 * k));
+        out[size - 4 + k] = (unsigned char)(len >> (8 * k));
+    }
+    return size;
+}
+
+static int write_file(const char *path, const unsigned char *buf, size_t len) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buf, 1, len, fp) != len) {
+        perror(path);
+        return 1;
+    }
+    return fclose(fp);
+}
+
+/* parse the offsets printed by xsp (hex) or bf (decimal) */
+static unsigned long long *run_offsets(const char *cmd, int *count) {
+    FILE *fp = popen(cmd, "r");
+    size_t cap = 256;
+    unsigned long long *offs = malloc(cap * sizeof(*offs));
+    *count = 0;
+    char line[256];
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char *end;
+        unsigned long long off = strtoull(line, &end, 0);
+        if (end == line || (*end != '\n' && *end != ' '))
+            continue;
+        if ((size_t)*count == cap) {
+            cap *= 2;
+            offs = realloc(offs, cap * sizeof(*offs));
+        }
+        offs[(*count)++] = off;
+    }
+    if (fp != NULL)
+        pclose(fp);
+    return offs;
+}
+
+static void compare(const char *cmd, unsigned long long *got, int ngot, unsigned long long *want, int nwant) {
+    int i = 0;
+    while (i < ngot && i < nwant && got[i] == want[i])
+        i++;
+    if (i == ngot && i == nwant)
+        return;
+    fprintf(stderr, "%s: %d matches, expected %d", cmd, ngot, nwant);
+    if (i < ngot && i < nwant)
+        fprintf(stderr, ", #%d is 0x%llx, expected 0x%llx", i, got[i], want[i]);
+    fputc('\n', stderr);
+    failures++;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: decompress_test <xsp> <bf> <scratch prefix>\n");
+        return 1;
+    }
+    const char *xsp = argv[1], *bf = argv[2];
+
+    // compressible text, with planted patterns across stream blocks, members and BGZF blocks
+    unsigned char *raw = malloc(RAW_SIZE);
+    for (size_t i = 0; i < RAW_SIZE; i++)
+        raw[i] = rnd() % 32 == 0 ? (unsigned char)rnd() : (unsigned char)("acgt"[rnd() % 4]);
+    const size_t plen = 40;
+    unsigned char pat[40];
+    for (size_t k = 0; k < plen; k++)
+        pat[k] = (unsigned char)("ACGT"[rnd() % 4]);
+    const size_t planted[] = {0, BGZF_BLOCK - 7, MEMBER_SIZE - 20, 2 * MEMBER_SIZE - 1, DECOMP_BLOCK - 39,
+                              2 * DECOMP_BLOCK - 1, 5 * BGZF_BLOCK + 12345, RAW_SIZE - plen};
+    for (size_t p = 0; p < sizeof(planted) / sizeof(planted[0]); p++)
+        memcpy(raw + planted[p], pat, plen);
+
+    char paths[4][4096];
+    const char *names[] = {"raw", "gz", "members.gz", "bgzf.gz"};
+    for (int f = 0; f < 4; f++)
+        snprintf(paths[f], sizeof(paths[f]), "%s.%s", argv[3], names[f]);
+    unsigned char *out = malloc(RAW_SIZE + RAW_SIZE / 2 + 0x10000);
+    size_t len = 0;
+    if (write_file(paths[0], raw, RAW_SIZE) != 0)
+        return 1;
+    len = gzip_member(out, raw, RAW_SIZE);
+    if (write_file(paths[1], out, len) != 0)
+        return 1;
+    len = 0;
+    for (size_t off = 0; off < RAW_SIZE; off += MEMBER_SIZE)
+        len += gzip_member(out + len, raw + off, RAW_SIZE - off < MEMBER_SIZE ? RAW_SIZE - off : MEMBER_SIZE);
+    if (write_file(paths[2], out, len) != 0)
+        return 1;
+    len = 0;
+    for (size_t off = 0; off < RAW_SIZE; off += BGZF_BLOCK)
+        len += bgzf_block(out + len, raw + off, RAW_SIZE - off < BGZF_BLOCK ? RAW_SIZE - off : BGZF_BLOCK);
+    len += bgzf_block(out + len, raw, 0); // end of file marker
+    if (write_file(paths[3], out, len) != 0)
+        return 1;
+
+    // a planted pattern, one made mostly of the text, and a single byte
+    char hexes[3][2 * 40 + 1];
+    for (size_t k = 0; k < plen; k++)
+        sprintf(hexes[0] + 2 * k, "%02x", pat[k]);
+    for (size_t k = 0; k < 6; k++)
+        sprintf(hexes[1] + 2 * k, "%02x", raw[DECOMP_BLOCK - 3 + k]);
+    sprintf(hexes[2], "%02x", 'A');
+    const char *opts[] = {"-t 1", "-t 3"};
+    for (int h = 0; h < 3; h++) {
+        char cmd[8192];
+        int nwant, ngot;
+        snprintf(cmd, sizeof(cmd), "%s -f %s %s", bf, paths[0], hexes[h]);
+        unsigned long long *want = run_offsets(cmd, &nwant);
+        for (int f = 1; f < 4; f++) {
+            for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+                snprintf(cmd, sizeof(cmd), "%s %s --decompress=auto -f %s %s", xsp, opts[o], paths[f], hexes[h]);
+                unsigned long long *got = run_offsets(cmd, &ngot);
+                compare(cmd, got, ngot, want, nwant);
+                free(got);
+            }
+        }
+        free(want);
+    }
+
+    for (int f = 0; f < 4; f++)
+        remove(paths[f]);
+    free(out);
+    free(raw);
+    return failures != 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+patches written while later chunks are still searched: every range, split
+across threads and windows, leaves the bytes of a single-threaded run and
+of a brute-force patch of the original file
+usage: patch_test <xsp> <tmpfile>
+*/
+
+#define FILE_SIZE   (8 * 1024 * 1024 + 333)
+#define PATTERN     "61616161"
+#define REPLACE     "7a617a7a"
+#define PATTERN_LEN 4
+
+static unsigned long long rng_state = 0x94d049bb133111ebULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int failures = 0;
+
+static int write_file(const char *path, const unsigned char *buf) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(path);
+        return 1;
+    }
+    return fclose(fp);
+}
+
+static int read_file(const char *path, unsigned char *buf) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL || fread(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(path);
+        if (fp != NULL)
+            fclose(fp);
+        return 1;
+    }
+    return fclose(fp);
+}
+
+/* xsp's range rules on `total` matches, false when it is rejected */
+static int resolve(int left, int right, int total, int *from, int *to) {
+    if (left < 0)
+        left += total;
+    if (right < 0)
+        right += total;
+    *from = left;
+    *to = right;
+    return 0 <= left && left <= right && right < total;
+}
+
+/* every match of the original bytes in the range, patched in order */
+static void brute_force(unsigned char *buf, int left, int right) {
+    size_t *offs = malloc(FILE_SIZE * sizeof(size_t));
+    int total = 0;
+    for (size_t i = 0; i + PATTERN_LEN <= FILE_SIZE; i++) {
+        if (memcmp(buf + i, "aaaa", PATTERN_LEN) == 0)
+            offs[total++] = i;
+    }
+    int from, to;
+    if (total > 0 && resolve(left, right, total, &from, &to)) {
+        for (int k = from; k <= to; k++)
+            memcpy(buf + offs[k], "zazz", PATTERN_LEN);
+    }
+    free(offs);
+}
+
+/* patch a fresh copy of `orig` and return its stdout, the patched bytes are left in `out` */
+static void patch(const char *xsp, const char *opts, const char *range, const char *path,
+                  const unsigned char *orig, unsigned char *out, char *text, size_t size) {
+    char cmd[4096];
+    text[0] = '\0';
+    if (write_file(path, orig) != 0) {
+        failures++;
+        return;
+    }
+    snprintf(cmd, sizeof(cmd), "%s %s -r %s -f %s " PATTERN " " REPLACE " 2>&1", xsp, opts, range, path);
+    FILE *p = popen(cmd, "r");
+    size_t n = p != NULL ? fread(text, 1, size - 1, p) : 0;
+    text[n] = '\0';
+    if (p != NULL)
+        pclose(p);
+    if (read_file(path, out) != 0)
+        failures++;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: patch_test <xsp> <tmpfile>\n");
+        return 1;
+    }
+
+    /*
+    four letters, so "aaaa" matches every few hundred bytes and runs of it
+    overlap, with long runs across every MiB so matches straddle chunk and
+    window edges, where a patch written too early would hide the next match
+    */
+    unsigned char *orig = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        orig[i] = (unsigned char)("abcd"[rnd() % 4]);
+    for (size_t at = 1024 * 1024; at < FILE_SIZE; at += 1024 * 1024)
+        memset(orig + at - 5, 'a', 11);
+
+    const struct {
+        const char *arg;
+        int left, right;
+    } ranges[] = {
+        {"0,-1", 0, -1},
+        {"3,-1", 3, -1},
+        {"-5,-1", -5, -1},
+        {"10,20", 10, 20},
+        {"0,100000000", 0, 100000000},
+        {"-100000000,-1", -100000000, -1},
+    };
+    // one thread with windows runs the chunks in order, each is patched before the next is searched
+    const char *opts[] = {"-t 1 --window 1M", "-t 4", "-t 4 --window 1M", "-t 3 --window 1M"};
+    unsigned char *want = malloc(FILE_SIZE), *single = malloc(FILE_SIZE), *got = malloc(FILE_SIZE);
+    char single_text[4096], got_text[4096];
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        memcpy(want, orig, FILE_SIZE);
+        brute_force(want, ranges[r].left, ranges[r].right);
+        patch(argv[1], "-t 1", ranges[r].arg, argv[2], orig, single, single_text, sizeof(single_text));
+        if (memcmp(single, want, FILE_SIZE) != 0) {
+            fprintf(stderr, "-t 1 -r %s: patched bytes differ from a brute-force patch\n", ranges[r].arg);
+            failures++;
+        }
+        for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+            patch(argv[1], opts[o], ranges[r].arg, argv[2], orig, got, got_text, sizeof(got_text));
+            if (strcmp(got_text, single_text) != 0) {
+                fprintf(stderr, "%s -r %s:\n%sexpected:\n%s", opts[o], ranges[r].arg, got_text, single_text);
+                failures++;
+            }
+            if (memcmp(got, single, FILE_SIZE) != 0) {
+                size_t at = 0;
+                while (got[at] == single[at])
+                    at++;
+                fprintf(stderr, "%s -r %s: first differing byte at 0x%zx\n", opts[o], ranges[r].arg, at);
+                failures++;
+            }
+        }
+    }
+    remove(argv[2]);
+    free(got);
+    free(single);
+    free(want);
+    free(orig);
+    return failures != 0;
+}
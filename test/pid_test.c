@@ -0,0 +1,151 @@
+#define _GNU_SOURCE // PR_SET_PTRACER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+/*
+--pid against a child process with markers at known addresses
+usage: pid_test <xsp>
+
+the marker bytes are only ever built inside the child's mapping, so the
+parent's copy of the address space can't hold a stray one. the mapping is
+aligned to PID_BATCH so one marker straddles the edge between two batches
+*/
+
+#define PID_BATCH   (4 * 1024 * 1024)
+#define MAP_LEN     (3 * PID_BATCH)
+#define MARKER_LEN  16
+
+static const size_t marker_at[] = {
+    0x123,
+    PID_BATCH - MARKER_LEN / 2,        // across the first batch edge
+    2 * PID_BATCH + 0x4000,
+    MAP_LEN - MARKER_LEN,              // last bytes of the mapping
+};
+#define NMARKERS (sizeof(marker_at) / sizeof(marker_at[0]))
+
+static unsigned marker_byte(unsigned seed, int k) {
+    return (seed * 2654435761u + (unsigned)k * 97u + 0x5a) & 0xff;
+}
+
+static unsigned replace_byte(unsigned seed, int k) {
+    return marker_byte(seed, k) ^ 0xff;
+}
+
+static void to_hex(char *out, unsigned seed, unsigned (*byte)(unsigned, int)) {
+    for (int k = 0; k < MARKER_LEN; k++)
+        sprintf(out + 2 * k, "%02x", byte(seed, k));
+}
+
+/* inaccessible reservations on both sides keep the mapping from merging with a neighbour */
+static unsigned char *aligned_map() {
+    unsigned char *raw = mmap(NULL, MAP_LEN + 2 * PID_BATCH, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    unsigned char *start = (unsigned char *)(((uintptr_t)raw + 2 * PID_BATCH - 1) / PID_BATCH * PID_BATCH);
+    if (mprotect(start, MAP_LEN, PROT_READ | PROT_WRITE) != 0)
+        return NULL;
+    return start;
+}
+
+/* place the markers, wait for the parent, then report whether they were patched */
+static int child_main(unsigned char *map, unsigned seed, int ready, int go) {
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+    for (size_t m = 0; m < NMARKERS; m++)
+        for (int k = 0; k < MARKER_LEN; k++)
+            map[marker_at[m] + k] = (unsigned char)marker_byte(seed, k);
+    char c = 0;
+    if (write(ready, &c, 1) != 1 || read(go, &c, 1) != 1)
+        return 2;
+    for (size_t m = 0; m < NMARKERS; m++)
+        for (int k = 0; k < MARKER_LEN; k++)
+            if (map[marker_at[m] + k] != (unsigned char)replace_byte(seed, k))
+                return 1;
+    return 0;
+}
+
+static int run(const char *cmd, char *out, size_t size) {
+    FILE *fp = popen(cmd, "r");
+    if (fp == NULL)
+        return -1;
+    size_t n = fread(out, 1, size - 1, fp);
+    out[n] = '\0';
+    return pclose(fp);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: pid_test <xsp>\n");
+        return 1;
+    }
+    unsigned char *map = aligned_map();
+    if (map == NULL) {
+        perror("mmap");
+        return 1;
+    }
+    unsigned seed = (unsigned)getpid();
+
+    int ready[2], go[2];
+    if (pipe(ready) != 0 || pipe(go) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0)
+        _exit(child_main(map, seed, ready[1], go[0]));
+
+    int failed = 0;
+    char c, cmd[512], out[4096], find[2 * MARKER_LEN + 1], replace[2 * MARKER_LEN + 1];
+    if (read(ready[0], &c, 1) != 1) {
+        fprintf(stderr, "child did not start\n");
+        failed = 1;
+        goto exit;
+    }
+
+    // search: every marker is reported at its address in the child, nothing else
+    to_hex(find, seed, marker_byte);
+    snprintf(cmd, sizeof(cmd), "%s --pid %d %s", argv[1], (int)child, find);
+    run(cmd, out, sizeof(out));
+    char expected[4096];
+    size_t len = 0;
+    for (size_t m = 0; m < NMARKERS; m++)
+        len += (size_t)sprintf(expected + len, "0x%llx\n", (unsigned long long)(uintptr_t)(map + marker_at[m]));
+    sprintf(expected + len, "%zu(%zu) matches found\n", NMARKERS, NMARKERS);
+    if (strcmp(out, expected) != 0) {
+        fprintf(stderr, "search:\n%sexpected:\n%s", out, expected);
+        failed = 1;
+        goto exit;
+    }
+
+    // patch through /proc/<pid>/mem
+    to_hex(replace, seed, replace_byte);
+    snprintf(cmd, sizeof(cmd), "%s --pid %d %s %s", argv[1], (int)child, find, replace);
+    run(cmd, out, sizeof(out));
+    sprintf(expected, "%zu(%zu) matches patched\n", NMARKERS, NMARKERS);
+    if (strcmp(out, expected) != 0) {
+        fprintf(stderr, "patch:\n%sexpected:\n%s", out, expected);
+        failed = 1;
+    }
+
+exit:
+    if (write(go[1], &c, 1) != 1)
+        kill(child, SIGKILL);
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "child memory was not patched\n");
+        failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "anchored_memchr/anchored_memchr.h"
+
+/*
+match kernels and pattern sets against a brute-force scan, then xsp against bf
+usage: search_test <xsp> <bf> <tmpfile>
+*/
+
+#define FILE_SIZE   (6 * 1024 * 1024)
+
+static int failures = 0;
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+/* mostly a 3-letter alphabet so short patterns match often and overlap */
+static void fill(unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        buf[i] = rnd() % 8 == 0 ? (unsigned char)rnd() : (unsigned char)('a' + rnd() % 3);
+}
+
+// same loop as test/bf.c
+static offset_t *brute_force(const unsigned char *buf, size_t len, const unsigned char *pat, size_t plen,
+                             int *count) {
+    offset_t *offs = malloc((len + 1) * sizeof(offset_t));
+    int matched = 0;
+    for (size_t i = 0; i + plen <= len; i++) {
+        if (memcmp(pat, buf + i, plen) == 0)
+            offs[matched++] = i;
+    }
+    *count = matched;
+    return offs;
+}
+
+static void compare(const char *what, size_t plen, size_t len, offset_t *got, int ngot, offset_t *want, int nwant) {
+    int i = 0;
+    while (i < ngot && i < nwant && got[i] == want[i])
+        i++;
+    if (i == ngot && i == nwant)
+        return;
+    fprintf(stderr, "%s: pattern %zu bytes in %zu: %d matches, expected %d", what, plen, len, ngot, nwant);
+    if (i < ngot && i < nwant)
+        fprintf(stderr, ", #%d is 0x%llx, expected 0x%llx", i, got[i], want[i]);
+    fputc('\n', stderr);
+    failures++;
+}
+
+/* one length: a pattern taken from the buffer, planted at both ends, on buffers cut at several lengths */
+static void check_length(size_t plen) {
+    size_t size = 256 * 1024 + 4 * plen;
+    unsigned char *buf = malloc(size);
+    fill(buf, size);
+    unsigned char *pat = malloc(plen);
+    memcpy(pat, buf + rnd() % (size - plen), plen);
+    memcpy(buf, pat, plen);
+    memcpy(buf + size / 2, pat, plen);
+    memcpy(buf + size - plen, pat, plen);
+
+    anchored_memchr_idx_t idx;
+    anchored_memchr_init(&idx, plen, pat);
+    for (size_t cut = 0; cut < 4 && cut <= size - plen; cut++) {
+        size_t len = size - cut;
+        int ngot, nwant;
+        offset_t *got = anchored_memchr_match(&idx, buf, buf + len, &ngot);
+        offset_t *want = brute_force(buf, len, pat, plen, &nwant);
+        compare("kernel", plen, len, got, ngot, want, nwant);
+        free(got);
+        free(want);
+    }
+    anchored_memchr_release(&idx);
+    free(pat);
+    free(buf);
+}
+
+static void check_kernels() {
+    // every short length class, then the u8, u16 and u32 position widths
+    for (size_t plen = 1; plen <= 40; plen++)
+        check_length(plen);
+    const size_t long_lengths[] = {63, 64, 255, 256, 257, 1000, 0x10000, 0x10001, 70000};
+    for (size_t i = 0; i < sizeof(long_lengths) / sizeof(long_lengths[0]); i++)
+        check_length(long_lengths[i]);
+
+    // runs of one byte: every position is a candidate at every anchor
+    unsigned char *buf = malloc(4096);
+    memset(buf, 'a', 4096);
+    buf[1000] = 'b';
+    for (size_t plen = 1; plen <= 33; plen++) {
+        anchored_memchr_idx_t idx;
+        anchored_memchr_init(&idx, plen, buf);
+        int ngot, nwant;
+        offset_t *got = anchored_memchr_match(&idx, buf, buf + 4096, &ngot);
+        offset_t *want = brute_force(buf, 4096, buf, plen, &nwant);
+        compare("run", plen, 4096, got, ngot, want, nwant);
+        free(got);
+        free(want);
+        anchored_memchr_release(&idx);
+    }
+    free(buf);
+}
+
+/* parse the offsets printed by xsp (hex) or bf (decimal) */
+static offset_t *run_offsets(const char *cmd, int *count) {
+    FILE *fp = popen(cmd, "r");
+    size_t cap = 256;
+    offset_t *offs = malloc(cap * sizeof(offset_t));
+    *count = 0;
+    char line[256];
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char *end;
+        offset_t off = strtoull(line, &end, 0);
+        if (end == line || (*end != '\n' && *end != ' '))
+            continue;
+        if ((size_t)*count == cap) {
+            cap *= 2;
+            offs = realloc(offs, cap * sizeof(offset_t));
+        }
+        offs[(*count)++] = off;
+    }
+    if (fp != NULL)
+        pclose(fp);
+    return offs;
+}
+
+/* `str` as ascii, utf16le or utf16be, letters folded when icase */
+static anchored_memchr_var_t encode(const char *str, int enc, bool icase) {
+    size_t n = strlen(str), unit = enc == 0 ? 1 : 2;
+    anchored_memchr_var_t var = {n * unit, calloc(n * unit, 1), calloc(n * unit, 1)};
+    for (size_t i = 0; i < n; i++) {
+        size_t at = i * unit + (enc == 2 ? 1 : 0);
+        var.patt[at] = (unsigned char)str[i];
+        if (icase && isalpha((unsigned char)str[i]))
+            var.fold[at] = 0x20;
+    }
+    return var;
+}
+
+/* the first variant matching at a position is the one reported */
+static offset_t *brute_force_set(const unsigned char *buf, size_t len, const anchored_memchr_var_t *vars, int nvar,
+                                 int *count) {
+    offset_t *offs = malloc((len + 1) * sizeof(offset_t));
+    int matched = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int v = 0; v < nvar; v++) {
+            size_t k = 0;
+            while (k < vars[v].len && i + k < len &&
+                   (buf[i + k] | vars[v].fold[k]) == (vars[v].patt[k] | vars[v].fold[k]))
+                k++;
+            if (k == vars[v].len) {
+                offs[matched++] = (offset_t)i | (offset_t)v << OFFSET_BITS;
+                break;
+            }
+        }
+    }
+    *count = matched;
+    return offs;
+}
+
+/* mixed case letters and zeros, so every encoding and case finds matches */
+static void fill_text(unsigned char *buf, size_t len) {
+    static const char text[] = "abcABC\0\0";
+    for (size_t i = 0; i < len; i++)
+        buf[i] = rnd() % 16 == 0 ? (unsigned char)rnd() : (unsigned char)text[rnd() % 8];
+}
+
+/*
+ascii, utf16le and utf16be in several orders, with and without --icase,
+then xsp on the same bytes split across threads, where variants differ in length
+*/
+static void check_sets(const char *xsp, const char *path) {
+    const char *strs[] = {"a", "ab", "cab", "abcab", "bacabcab", "abcabcabcabcabcab"};
+    const int encs[][3] = {{0, 1, 2}, {1, 0, 2}, {0, 1, -1}, {2, -1, -1}, {0, -1, -1}};
+    size_t size = 128 * 1024;
+    unsigned char *buf = malloc(size);
+    fill_text(buf, size);
+    for (size_t s = 0; s < sizeof(strs) / sizeof(strs[0]); s++) {
+        for (size_t e = 0; e < sizeof(encs) / sizeof(encs[0]); e++) {
+            for (int icase = 0; icase <= 1; icase++) {
+                anchored_memchr_var_t vars[3];
+                int nvar = 0;
+                while (nvar < 3 && encs[e][nvar] >= 0) {
+                    vars[nvar] = encode(strs[s], encs[e][nvar], icase);
+                    nvar++;
+                }
+                anchored_memchr_idx_t idx;
+                anchored_memchr_init_set(&idx, nvar, vars);
+                int ngot, nwant;
+                offset_t *got = anchored_memchr_match(&idx, buf, buf + size, &ngot);
+                offset_t *want = brute_force_set(buf, size, vars, nvar, &nwant);
+                compare("set", vars[0].len, size, got, ngot, want, nwant);
+                free(got);
+                anchored_memchr_release(&idx);
+                if (e == 0 && icase) {
+                    FILE *fp = fopen(path, "wb");
+                    fwrite(buf, 1, size, fp);
+                    fclose(fp);
+                    char cmd[1024];
+                    snprintf(cmd, sizeof(cmd), "%s -t 4 -f %s --str --icase --encoding=ascii,utf16le,utf16be %s",
+                             xsp, path, strs[s]);
+                    got = run_offsets(cmd, &ngot);
+                    for (int i = 0; i < nwant; i++)
+                        want[i] = offset_of(want[i]);
+                    compare("xsp --str", vars[0].len, size, got, ngot, want, nwant);
+                    free(got);
+                    remove(path);
+                }
+                free(want);
+                for (int v = 0; v < nvar; v++) {
+                    free(vars[v].patt);
+                    free(vars[v].fold);
+                }
+            }
+        }
+    }
+    free(buf);
+}
+
+/* the whole pipeline: chunk overlaps, thread split and windows */
+static void check_xsp(const char *xsp, const char *bf, const char *path) {
+    unsigned char *buf = malloc(FILE_SIZE);
+    fill(buf, FILE_SIZE);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(path);
+        failures++;
+        free(buf);
+        return;
+    }
+    fclose(fp);
+
+    const char *opts[] = {"-t 1", "-t 4", "-t 3 --window 1M"};
+    const size_t lengths[] = {2, 5, 12, 20, 40};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        char hex[2 * 40 + 1];
+        size_t at = FILE_SIZE / 2 + rnd() % 4096;
+        for (size_t k = 0; k < lengths[l]; k++)
+            sprintf(hex + 2 * k, "%02x", buf[at + k]);
+        char cmd[1024];
+        int nwant;
+        snprintf(cmd, sizeof(cmd), "%s -f %s %s", bf, path, hex);
+        offset_t *want = run_offsets(cmd, &nwant);
+        for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+            int ngot;
+            snprintf(cmd, sizeof(cmd), "%s %s -f %s %s", xsp, opts[o], path, hex);
+            offset_t *got = run_offsets(cmd, &ngot);
+            compare(opts[o], lengths[l], FILE_SIZE, got, ngot, want, nwant);
+            free(got);
+        }
+        free(want);
+    }
+    remove(path);
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: search_test <xsp> <bf> <tmpfile>\n");
+        return 1;
+    }
+    check_kernels();
+    check_sets(argv[1], argv[3]);
+    check_xsp(argv[1], argv[2], argv[3]);
+    return failures != 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+--connect against a local run: searches and patches through a daemon
+started on a temporary socket print the same text and leave the same bytes
+usage: serve_test <xsp> <scratch prefix>
+*/
+
+#define FILE_SIZE (3 * 1024 * 1024 + 777)
+
+static unsigned long long rng_state = 0x853c49e6748fea9bULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int failures = 0;
+
+/* stdout and stderr of `cmd`, followed by its exit status */
+static void run(const char *cmd, char *out, size_t size) {
+    char full[4096];
+    snprintf(full, sizeof(full), "%s 2>&1", cmd);
+    FILE *p = popen(full, "r");
+    size_t n = p != NULL ? fread(out, 1, size - 64, p) : 0;
+    out[n] = '\0';
+    int status = p != NULL ? pclose(p) : -1;
+    sprintf(out + n, "exit %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+static int write_file(const char *path, const unsigned char *buf) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(path);
+        return 1;
+    }
+    return fclose(fp);
+}
+
+static unsigned char *read_file(const char *path) {
+    unsigned char *buf = malloc(FILE_SIZE);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL || fread(buf, 1, FILE_SIZE, fp) != FILE_SIZE)
+        memset(buf, 0, FILE_SIZE);
+    if (fp != NULL)
+        fclose(fp);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: serve_test <xsp> <scratch prefix>\n");
+        return 1;
+    }
+    const char *xsp = argv[1];
+    char sock[4096], data[4096], local[4096], remote[4096];
+    snprintf(sock, sizeof(sock), "%s.sock", argv[2]);
+    snprintf(data, sizeof(data), "%s.bin", argv[2]);
+    snprintf(local, sizeof(local), "%s.local", argv[2]);
+    snprintf(remote, sizeof(remote), "%s.remote", argv[2]);
+
+    // mostly four letters, so 8-letter patterns match a few dozen times
+    unsigned char *buf = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        buf[i] = rnd() % 64 == 0 ? (unsigned char)rnd() : (unsigned char)("abcd"[rnd() % 4]);
+    if (write_file(data, buf) != 0)
+        return 1;
+
+    unlink(sock);
+    pid_t daemon = fork();
+    if (daemon < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (daemon == 0) {
+        execl(xsp, xsp, "--serve", sock, (char *)NULL);
+        _exit(127);
+    }
+    struct stat st;
+    for (int i = 0; i < 500 && stat(sock, &st) != 0; i++)
+        usleep(10000);
+
+    char cmd[8192], want[65536], got[65536];
+    // patterns with a few dozen matches, one with none, and one matching everywhere
+    const char *searches[] = {"6162636461626364", "6464646464646464", "00ff00ff", "61"};
+    const char *ranges[] = {"", "-r 2,5", "-r -3,-1", "-r 100000000,-1"};
+    for (size_t s = 0; s < sizeof(searches) / sizeof(searches[0]); s++) {
+        for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+            if (strcmp(searches[s], "61") == 0 && r == 0)
+                continue; // a million lines
+            snprintf(cmd, sizeof(cmd), "%s %s -f %s %s", xsp, ranges[r], data, searches[s]);
+            run(cmd, want, sizeof(want));
+            snprintf(cmd, sizeof(cmd), "%s --connect %s %s -f %s %s", xsp, sock, ranges[r], data, searches[s]);
+            run(cmd, got, sizeof(got));
+            if (strcmp(got, want) != 0) {
+                fprintf(stderr, "%s\n%sexpected:\n%s", cmd, got, want);
+                failures++;
+            }
+        }
+    }
+
+    // patches: same output and same bytes, the daemon's mapping sees its own writes
+    const char *patches[][2] = {
+        {"", "6162616261626162"},
+        {"-r 1,3", "6363636363636363"},
+        {"-r -2,-1", "6161616161616161"},
+        {"", "0123456789abcdef"},
+    };
+    if (write_file(local, buf) != 0 || write_file(remote, buf) != 0)
+        failures++;
+    for (size_t p = 0; p < sizeof(patches) / sizeof(patches[0]) && failures == 0; p++) {
+        snprintf(cmd, sizeof(cmd), "%s %s -f %s %s 7a7a7a7a7a7a7a7a", xsp, patches[p][0], local, patches[p][1]);
+        run(cmd, want, sizeof(want));
+        snprintf(cmd, sizeof(cmd), "%s --connect %s %s -f %s %s 7a7a7a7a7a7a7a7a", xsp, sock, patches[p][0],
+                 remote, patches[p][1]);
+        run(cmd, got, sizeof(got));
+        if (strcmp(got, want) != 0) {
+            fprintf(stderr, "%s\n%sexpected:\n%s", cmd, got, want);
+            failures++;
+        }
+        unsigned char *a = read_file(local), *b = read_file(remote);
+        if (memcmp(a, b, FILE_SIZE) != 0) {
+            fprintf(stderr, "%s: patched bytes differ from a local patch\n", cmd);
+            failures++;
+        }
+        free(a);
+        free(b);
+    }
+    // the patched file searched again through the warm mapping
+    snprintf(cmd, sizeof(cmd), "%s -f %s 7a7a7a7a7a7a7a7a", xsp, local);
+    run(cmd, want, sizeof(want));
+    snprintf(cmd, sizeof(cmd), "%s --connect %s -f %s 7a7a7a7a7a7a7a7a", xsp, sock, remote);
+    run(cmd, got, sizeof(got));
+    if (strcmp(got, want) != 0) {
+        fprintf(stderr, "%s\n%sexpected:\n%s", cmd, got, want);
+        failures++;
+    }
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    remove(data);
+    remove(local);
+    remove(remote);
+    free(buf);
+    return failures != 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+sparse files: data written at unaligned offsets into a truncated file,
+patterns with leading and trailing zeros that cross a data/hole edge,
+offsets checked against bf on the same file
+usage: sparse_test <xsp> <bf> <tmpfile>
+*/
+
+#define FILE_SIZE   (48 * 1024 * 1024 + 4321)
+#define MAX_PATTERN (24 * 1024)
+
+static unsigned long long rng_state = 0x2545f4914f6cdd1dULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int failures = 0;
+
+/*
+data runs: one at the start, two split by a hole shorter than MIN_HOLE_SKIP
+so they merge into one extent, one past a long hole, one at the end
+*/
+static const struct {
+    size_t at, len;
+} runs[] = {
+    {0, 777},
+    {5 * 1024 * 1024 + 1234, 3000},
+    {5 * 1024 * 1024 + 1234 + 3000 + 20000, 5000},
+    {20 * 1024 * 1024 + 4095, 70001},
+    {FILE_SIZE - 100, 100},
+};
+#define NRUNS (sizeof(runs) / sizeof(runs[0]))
+
+/* parse the offsets printed by xsp (hex) or bf (decimal) */
+static unsigned long long *run_offsets(const char *cmd, int *count) {
+    FILE *fp = popen(cmd, "r");
+    size_t cap = 256;
+    unsigned long long *offs = malloc(cap * sizeof(*offs));
+    *count = 0;
+    char line[256];
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char *end;
+        unsigned long long off = strtoull(line, &end, 0);
+        if (end == line || (*end != '\n' && *end != ' '))
+            continue;
+        if ((size_t)*count == cap) {
+            cap *= 2;
+            offs = realloc(offs, cap * sizeof(*offs));
+        }
+        offs[(*count)++] = off;
+    }
+    if (fp != NULL)
+        pclose(fp);
+    return offs;
+}
+
+static void compare(const char *cmd, unsigned long long *got, int ngot, unsigned long long *want, int nwant) {
+    int i = 0;
+    while (i < ngot && i < nwant && got[i] == want[i])
+        i++;
+    if (i == ngot && i == nwant)
+        return;
+    fprintf(stderr, "%.200s...: %d matches, expected %d", cmd, ngot, nwant);
+    if (i < ngot && i < nwant)
+        fprintf(stderr, ", #%d is 0x%llx, expected 0x%llx", i, got[i], want[i]);
+    fputc('\n', stderr);
+    failures++;
+}
+
+/* `len` bytes of the file image at `at`, zeros outside the runs */
+static void image(const unsigned char *data, size_t at, size_t len, unsigned char *out) {
+    memset(out, 0, len);
+    for (size_t r = 0; r < NRUNS; r++) {
+        size_t from = runs[r].at > at ? runs[r].at : at;
+        size_t to = runs[r].at + runs[r].len < at + len ? runs[r].at + runs[r].len : at + len;
+        if (from < to)
+            memcpy(out + from - at, data + r * 0x20000 + (from - runs[r].at), to - from);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: sparse_test <xsp> <bf> <tmpfile>\n");
+        return 1;
+    }
+    const char *xsp = argv[1], *bf = argv[2], *path = argv[3];
+
+    // the content of run r starts at data + r * 0x20000
+    unsigned char *data = malloc(NRUNS * 0x20000);
+    for (size_t i = 0; i < NRUNS * 0x20000; i++)
+        data[i] = (unsigned char)(1 + rnd() % 255);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, FILE_SIZE) != 0) {
+        perror(path);
+        return 1;
+    }
+    for (size_t r = 0; r < NRUNS; r++) {
+        if (pwrite(fd, data + r * 0x20000, runs[r].len, (off_t)runs[r].at) != (ssize_t)runs[r].len) {
+            perror(path);
+            return 1;
+        }
+    }
+    close(fd);
+
+    // patterns as (start, length) in the file image
+    const struct {
+        size_t at, len;
+    } pats[] = {
+        {5 * 1024 * 1024 + 1234 - 6000, 6008},              // zeros from the hole in front, then data
+        {5 * 1024 * 1024 + 1234 + 3000 - 8, 20016},         // across the short hole between merged runs
+        {20 * 1024 * 1024 + 4095 + 70001 - 16, 9000},       // data, then zeros into the hole behind
+        {20 * 1024 * 1024 + 4095 - 100, 116},               // a few zeros, still inside the first data page
+        {FILE_SIZE - 100 - 3000, 3004},                     // into the run at the end of file
+        {700, 5000},                                        // the first run into the hole after it
+        {20 * 1024 * 1024 + 30000, 12},                     // inside data
+    };
+    unsigned char *pat = malloc(MAX_PATTERN);
+    char *hex = malloc(2 * MAX_PATTERN + 1);
+    char *cmd = malloc(2 * MAX_PATTERN + 4096);
+    char cache[4096];
+    snprintf(cache, sizeof(cache), "%s.cache", path);
+    const char *opts[] = {"-t 1", "-t 3", "-t 3 --window 1M", "-t 2 --cache"};
+    for (size_t p = 0; p < sizeof(pats) / sizeof(pats[0]); p++) {
+        image(data, pats[p].at, pats[p].len, pat);
+        for (size_t k = 0; k < pats[p].len; k++)
+            sprintf(hex + 2 * k, "%02x", pat[k]);
+        int nwant, ngot;
+        snprintf(cmd, 2 * MAX_PATTERN + 4096, "%s -f %s %s", bf, path, hex);
+        unsigned long long *want = run_offsets(cmd, &nwant);
+        if (nwant == 0) {
+            fprintf(stderr, "pattern at 0x%zx: bf found nothing\n", pats[p].at);
+            failures++;
+        }
+        for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+            snprintf(cmd, 2 * MAX_PATTERN + 4096, "%s %s%s%s -f %s %s", xsp, opts[o],
+                     strstr(opts[o], "--cache") != NULL ? " " : "",
+                     strstr(opts[o], "--cache") != NULL ? cache : "", path, hex);
+            unsigned long long *got = run_offsets(cmd, &ngot);
+            compare(cmd, got, ngot, want, nwant);
+            free(got);
+        }
+        free(want);
+    }
+
+    snprintf(cmd, 4096, "rm -rf '%s'", cache);
+    if (system(cmd) != 0)
+        failures++;
+    remove(path);
+    free(cmd);
+    free(hex);
+    free(pat);
+    free(data);
+    return failures != 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+--unique-at against a brute-force search for the shortest unique window
+usage: unique_test <xsp> <tmpfile>
+*/
+
+#define FILE_SIZE       (32 * 1024)
+#define UNIQUE_MAX_LEN  256
+
+static unsigned long long rng_state = 0x2545f4914f6cdd1dULL;
+
+static unsigned rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static int occurs_once(const unsigned char *buf, size_t size, size_t s, size_t len) {
+    int seen = 0;
+    for (size_t p = 0; p + len <= size; p++) {
+        if (buf[p] == buf[s] && memcmp(buf + p, buf + s, len) == 0 && ++seen > 1)
+            return 0;
+    }
+    return 1;
+}
+
+/* what xsp should print: the shortest window, ties to the start closest to the target */
+static void expected_output(const unsigned char *buf, size_t size, size_t target, char *out) {
+    size_t best_start = 0, best_len = 0;
+    size_t first = target >= UNIQUE_MAX_LEN - 1 ? target - (UNIQUE_MAX_LEN - 1) : 0;
+    for (size_t s = target + 1; s-- > first;) {
+        size_t lo = target - s + 1, hi = UNIQUE_MAX_LEN;
+        if (s + hi > size)
+            hi = size - s;
+        if (lo > hi || !occurs_once(buf, size, s, hi))
+            continue;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (occurs_once(buf, size, s, mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (best_len == 0 || lo < best_len) {
+            best_start = s;
+            best_len = lo;
+        }
+    }
+    if (best_len == 0) {
+        sprintf(out, "no unique signature up to %d bytes covers 0x%zx\n", UNIQUE_MAX_LEN, target);
+        return;
+    }
+    out += sprintf(out, "0x%zx: ", best_start);
+    for (size_t i = 0; i < best_len; i++)
+        out += sprintf(out, "%02x", buf[best_start + i]);
+    sprintf(out, "\n%zu bytes unique, target at +%zu\n", best_len, target - best_start);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: unique_test <xsp> <tmpfile>\n");
+        return 1;
+    }
+
+    /*
+    4-letter text, with copies planted so some signatures have to grow
+    past the copy: 100 bytes repeated twice, and 600 bytes with a middle
+    that no signature of up to 256 bytes can escape
+    */
+    unsigned char *buf = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        buf[i] = (unsigned char)("acgt"[rnd() % 4]);
+    memcpy(buf + 20000, buf + 4000, 100);
+    memcpy(buf + 24000, buf + 8000, 600);
+    FILE *fp = fopen(argv[2], "wb");
+    if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE) {
+        perror(argv[2]);
+        return 1;
+    }
+    fclose(fp);
+
+    const size_t targets[] = {0, 1, 255, 4000, 4050, 4099, 8150, 8300, 16000, 20050, FILE_SIZE - 1};
+    const char *opts[] = {"-t 1", "-t 3"};
+    int failures = 0;
+    for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+        char expected[1024], got[1024], cmd[1024];
+        expected_output(buf, FILE_SIZE, targets[t], expected);
+        for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+            snprintf(cmd, sizeof(cmd), "%s %s -f %s --unique-at 0x%zx", argv[1], opts[o], argv[2], targets[t]);
+            FILE *p = popen(cmd, "r");
+            size_t n = p != NULL ? fread(got, 1, sizeof(got) - 1, p) : 0;
+            got[n] = '\0';
+            if (p != NULL)
+                pclose(p);
+            if (strcmp(got, expected) != 0) {
+                fprintf(stderr, "%s:\n%sexpected:\n%s", cmd, got, expected);
+                failures++;
+            }
+        }
+    }
+    remove(argv[2]);
+    free(buf);
+    return failures != 0;
+}